@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "supdem_engine.h"
+
+// Microbenchmarks of the matching engine over synthetic workloads. Each
+// scenario prefills the tables, then runs a random mix of operations:
+//   insert  move a random client and insert a supply or a demand there
+//   match   one supdem_engine_match() pass, as after every server insert
+//   list    region query around a random point
+// and reports time, heap allocations and (where perf_event is available)
+// cache misses per operation.
+//
+// With -O it instead soaks an engine checked by its reference model under a
+// randomized workload, including watches, TTLs and client removal, and
+// fails on any divergence. With -C it runs such a workload on an engine per
+// supply index backend and fails unless all of them give the same results.
+
+#define MAX_CLUSTERS 8
+
+enum {
+    OP_INSERT,
+    OP_MATCH,
+    OP_LIST,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = { "insert", "match", "list" };
+
+typedef struct {
+    int clustered;
+    int radius;    // supply distance and list query radius
+    int fill;      // percent of table capacity inserted before timing
+    int mix[OP_COUNT];
+} scenario;
+
+typedef struct {
+    unsigned long count;
+    unsigned long ns;
+    unsigned long allocs;
+    unsigned long llc_misses;
+    unsigned long l1d_misses;
+} op_stats;
+
+static int width = 1000, height = 1000;
+static int ops = 2000;
+static unsigned int seed = 1;
+static int index_flags; // SUPDEM_INDEX() of the engines benchmarked
+
+// Heap allocations are counted by interposing malloc and friends
+static unsigned long alloc_count;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+// perf_event counters of this thread in user space; -1 when unavailable
+static int llc_fd = -1, l1d_fd = -1;
+
+static int open_counter(unsigned int type, unsigned long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long read_counter(int fd) {
+    unsigned long v = 0;
+    if (fd >= 0 && read(fd, &v, sizeof(v)) != sizeof(v)) v = 0;
+    return v;
+}
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int rand_range(int n) {
+    return rand_r(&seed) % n;
+}
+
+// Random position, uniform over the map or normal-ish around one of the
+// cluster centers
+static void random_point(const scenario *sc, const int (*centers)[2], int *x, int *y) {
+    if (!sc->clustered) {
+        *x = rand_range(width);
+        *y = rand_range(height);
+        return;
+    }
+    const int *c = centers[rand_range(MAX_CLUSTERS)];
+    int spread = (width < height ? width : height) / 20 + 1;
+    int dx = 0, dy = 0;
+    for (int i = 0; i < 4; i++) {
+        dx += rand_range(2 * spread + 1) - spread;
+        dy += rand_range(2 * spread + 1) - spread;
+    }
+    *x = c[0] + dx / 2;
+    *y = c[1] + dy / 2;
+    if (*x < 0) *x = 0;
+    if (*x >= width) *x = width - 1;
+    if (*y < 0) *y = 0;
+    if (*y >= height) *y = height - 1;
+}
+
+static unsigned long drain(supdem_engine *e) {
+    supdem_event events[256];
+    unsigned long total = 0;
+    int n;
+    while ((n = supdem_engine_drain(e, events, 256)) > 0) total += n;
+    return total;
+}
+
+static int insert_random(supdem_engine *e, const scenario *sc, const int (*centers)[2], int supply) {
+    int client = rand_range(SUPDEM_MAX_CLIENTS);
+    int x, y;
+    random_point(sc, centers, &x, &y);
+    supdem_engine_move(e, client, x, y);
+    if (supply) {
+        return supdem_engine_insert_supply(e, client, sc->radius, 5 + rand_range(20), 5 + rand_range(20),
+                                           5 + rand_range(20), 0);
+    }
+    return supdem_engine_insert_demand(e, client, 1 + rand_range(10), 1 + rand_range(10), 1 + rand_range(10), 0);
+}
+
+static void run_scenario(const scenario *sc) {
+    supdem_engine *e = supdem_engine_create(width, height, index_flags);
+    if (!e) {
+        perror("supdem_engine_create");
+        exit(EXIT_FAILURE);
+    }
+    int *found = malloc(SUPDEM_MAX_SUPPLY * sizeof(int));
+    int centers[MAX_CLUSTERS][2];
+    for (int i = 0; i < MAX_CLUSTERS; i++) {
+        centers[i][0] = rand_range(width);
+        centers[i][1] = rand_range(height);
+    }
+
+    // Prefill without matching, so the fill level is what the timed
+    // operations see
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY * sc->fill / 100; i++) insert_random(e, sc, centers, 1);
+    for (int i = 0; i < SUPDEM_MAX_DEMAND * sc->fill / 100; i++) insert_random(e, sc, centers, 0);
+    drain(e);
+
+    supdem_counts before;
+    supdem_engine_counts(e, &before);
+
+    op_stats stats[OP_COUNT];
+    memset(stats, 0, sizeof(stats));
+    int mix_total = sc->mix[OP_INSERT] + sc->mix[OP_MATCH] + sc->mix[OP_LIST];
+    unsigned long events = 0;
+
+    for (int i = 0; i < ops; i++) {
+        int r = rand_range(mix_total);
+        int op = r < sc->mix[OP_INSERT] ? OP_INSERT : r < sc->mix[OP_INSERT] + sc->mix[OP_MATCH] ? OP_MATCH : OP_LIST;
+        int supply = rand_range(2);
+        supdem_query q;
+        if (op == OP_LIST) {
+            q.near = 1;
+            random_point(sc, centers, &q.x, &q.y);
+            q.radius = sc->radius;
+            q.x1 = q.x - q.radius;
+            q.y1 = q.y - q.radius;
+            q.x2 = q.x + q.radius;
+            q.y2 = q.y + q.radius;
+            q.min_a = q.min_b = q.min_c = 0;
+            q.owner = -1;
+            q.after = -1;
+        }
+
+        unsigned long allocs = alloc_count;
+        unsigned long llc = read_counter(llc_fd);
+        unsigned long l1d = read_counter(l1d_fd);
+        unsigned long start = now_ns();
+        switch (op) {
+        case OP_INSERT:
+            insert_random(e, sc, centers, supply);
+            break;
+        case OP_MATCH:
+            supdem_engine_match(e);
+            break;
+        case OP_LIST:
+            supdem_engine_query(e, supply ? SUPDEM_SUPPLY : SUPDEM_DEMAND, &q, found);
+            break;
+        }
+        unsigned long elapsed = now_ns() - start;
+        op_stats *st = &stats[op];
+        st->count++;
+        st->ns += elapsed;
+        st->allocs += alloc_count - allocs;
+        st->llc_misses += read_counter(llc_fd) - llc;
+        st->l1d_misses += read_counter(l1d_fd) - l1d;
+        events += drain(e);
+    }
+
+    printf("%-9s radius %-4d fill %2d%% (%d supplies, %d demands), mix %d:%d:%d, %lu events\n",
+           sc->clustered ? "clustered" : "uniform", sc->radius, sc->fill, before.supplies, before.demands,
+           sc->mix[OP_INSERT], sc->mix[OP_MATCH], sc->mix[OP_LIST], events);
+    for (int op = 0; op < OP_COUNT; op++) {
+        op_stats *st = &stats[op];
+        if (st->count == 0) continue;
+        printf("  %-7s|%8lu|%14.1f|%10.2f|", op_names[op], st->count,
+               (double)st->ns / st->count, (double)st->allocs / st->count);
+        if (llc_fd >= 0) {
+            printf("%12.1f|", (double)st->llc_misses / st->count);
+        } else {
+            printf("%12s|", "n/a");
+        }
+        if (l1d_fd >= 0) {
+            printf("%12.1f|\n", (double)st->l1d_misses / st->count);
+        } else {
+            printf("%12s|\n", "n/a");
+        }
+    }
+
+    free(found);
+    supdem_engine_destroy(e);
+}
+
+// k-nearest by a scan of every slot, to check supdem_engine_nearest()
+static int nearest_scan(const supdem_engine *e, int x, int y, int k, int min, int *out) {
+    int n = 0;
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        const supdem_supply *s = supdem_engine_supply(e, i);
+        if (!s || s->a_amount < min || s->b_amount < min || s->c_amount < min) continue;
+        int d = abs(x - s->x) + abs(y - s->y);
+        int j = n < k ? n++ : k;
+        while (j > 0) {
+            const supdem_supply *p = supdem_engine_supply(e, out[j - 1]);
+            if (abs(x - p->x) + abs(y - p->y) <= d) break;
+            if (j < k) out[j] = out[j - 1];
+            j--;
+        }
+        if (j < k) out[j] = i;
+    }
+    return n;
+}
+
+// One random operation, applied alike to each of count engines: the random
+// draws are made once. Clients are few and the tables are kept small so
+// that matches, watch hits and expiries are frequent; the clock advances
+// every few operations. Returns the events of the first engine.
+static unsigned long random_step(supdem_engine **es, int count, int clients, unsigned long *now) {
+    scenario sc = { 0, 0, 0, { 0, 0, 0 } };
+    unsigned long events = 0;
+    int client = rand_range(clients);
+    int x, y;
+    random_point(&sc, NULL, &x, &y);
+    unsigned long ttl = rand_range(4) ? 0 : 1 + rand_range(200);
+    int r = rand_range(100);
+    int dist = 1 + rand_range(width / 4 + 1), a = 1 + rand_range(20), b = 1 + rand_range(20), c = 1 + rand_range(20);
+
+    if (r < 82) {
+        int da = 1 + rand_range(10), db = 1 + rand_range(10), dc = 1 + rand_range(10);
+        int ox = rand_range(width + 2) - 1, oy = rand_range(height + 2) - 1;
+        for (int i = 0; i < count; i++) {
+            supdem_engine *e = es[i];
+            if (r < 30) {
+                supdem_engine_move(e, client, x, y);
+                int id = supdem_engine_insert_supply(e, client, dist, a, b, c, ttl);
+                supdem_engine_match(e);
+                if (id >= 0) supdem_engine_announce(e, id);
+            } else if (r < 60) {
+                supdem_engine_move(e, client, x, y);
+                supdem_engine_insert_demand(e, client, da, db, dc, ttl);
+                supdem_engine_match(e);
+            } else if (r < 70) {
+                supdem_engine_move(e, client, ox, oy);
+            } else if (r < 78) {
+                supdem_engine_move(e, client, x, y);
+                supdem_engine_watch(e, client, dist);
+            } else if (r < 80) {
+                supdem_engine_unwatch(e, client);
+            } else {
+                supdem_engine_remove_client(e, client);
+            }
+        }
+    } else if (r < 84) {
+        // A batch: inserts of both kinds, some past what a match remembers, then one match
+        for (int n = 1 + rand_range(300); n > 0; n--) {
+            random_point(&sc, NULL, &x, &y);
+            int supply = rand_range(2);
+            dist = 1 + rand_range(width / 4 + 1);
+            a = 1 + rand_range(20);
+            b = 1 + rand_range(20);
+            c = 1 + rand_range(20);
+            for (int i = 0; i < count; i++) {
+                supdem_engine_move(es[i], client, x, y);
+                if (supply) supdem_engine_insert_supply(es[i], client, dist, a, b, c, ttl);
+                else supdem_engine_insert_demand(es[i], client, a / 2 + 1, b / 2 + 1, c / 2 + 1, ttl);
+            }
+        }
+        for (int i = 0; i < count; i++) supdem_engine_match(es[i]);
+    } else {
+        *now += 1 + rand_range(8);
+        for (int i = 0; i < count; i++) supdem_engine_advance(es[i], *now);
+    }
+    if (count == 1) events = drain(es[0]);
+    return events;
+}
+
+// Random operations on an oracle-checked engine. After each one a random
+// k-nearest query is checked against a full scan.
+static int soak() {
+    supdem_engine *e = supdem_engine_create(width, height, SUPDEM_ORACLE | index_flags);
+    if (!e) {
+        perror("supdem_engine_create");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int start_seed = seed;
+    unsigned long now = 0, events = 0, nearest_checks = 0, nearest_misses = 0;
+    scenario sc = { 0, 0, 0, { 0, 0, 0 } };
+
+    for (int i = 0; i < ops; i++) {
+        events += random_step(&e, 1, 64, &now);
+
+        int k = 1 + rand_range(8), min = rand_range(10), x, y;
+        int got[8], want[8];
+        random_point(&sc, NULL, &x, &y);
+        int n = supdem_engine_nearest(e, x, y, k, min, min, min, got);
+        nearest_checks++;
+        if (n != nearest_scan(e, x, y, k, min, want) || memcmp(got, want, n * sizeof(int)) != 0) {
+            nearest_misses++;
+        }
+    }
+
+    supdem_oracle_status st;
+    supdem_engine_oracle(e, &st);
+    supdem_counts counts;
+    supdem_engine_counts(e, &counts);
+    printf("Soak %dx%d (%s), %d ops, seed %u: %lu events, %lu expired, %lu checks, %lu divergences\n",
+           width, height, supdem_index_name(supdem_engine_index(e)), ops, start_seed, events, counts.expired,
+           st.checks, st.divergences);
+    if (st.divergences) printf("  last: %s\n", st.last);
+    printf("Nearest: %lu checks, %lu mismatches\n", nearest_checks, nearest_misses);
+    supdem_engine_destroy(e);
+    return st.divergences || nearest_misses ? EXIT_FAILURE : 0;
+}
+
+// Counts in mismatches[] each engine that queued other events than es[0]
+// since the last call
+static void compare_events(supdem_engine **es, int count, unsigned long *mismatches) {
+    supdem_event want[256], got[256];
+    int differs[SUPDEM_INDEX_COUNT] = { 0 };
+    int more;
+    do {
+        int n = supdem_engine_drain(es[0], want, 256);
+        more = n > 0;
+        for (int i = 1; i < count; i++) {
+            int m = supdem_engine_drain(es[i], got, 256);
+            if (n != m || memcmp(want, got, n * sizeof(supdem_event)) != 0) differs[i] = 1;
+            more |= m > 0;
+        }
+    } while (more);
+    for (int i = 1; i < count; i++) mismatches[i] += differs[i];
+}
+
+// Conformance of the index backends: the same random operations on an
+// engine per backend, with many clients so the tables fill up. Events,
+// region queries and k-nearest queries of each must equal those of the
+// linear backend.
+static int conform() {
+    supdem_engine *es[SUPDEM_INDEX_COUNT - 1];
+    int count = SUPDEM_INDEX_COUNT - 1;
+    unsigned long mismatches[SUPDEM_INDEX_COUNT - 1] = { 0 };
+    for (int i = 0; i < count; i++) {
+        es[i] = supdem_engine_create(width, height, SUPDEM_INDEX(SUPDEM_INDEX_LINEAR + i));
+        if (!es[i]) {
+            perror("supdem_engine_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned int start_seed = seed;
+    int *want = malloc(SUPDEM_MAX_SUPPLY * sizeof(int));
+    int *got = malloc(SUPDEM_MAX_SUPPLY * sizeof(int));
+    unsigned long now = 0;
+    scenario sc = { 0, 0, 0, { 0, 0, 0 } };
+
+    for (int op = 0; op < ops; op++) {
+        random_step(es, count, SUPDEM_MAX_CLIENTS, &now);
+        compare_events(es, count, mismatches);
+
+        supdem_query q;
+        random_point(&sc, NULL, &q.x, &q.y);
+        q.radius = rand_range(width / 2 + 1);
+        q.near = rand_range(2);
+        q.x1 = q.x - rand_range(width / 2 + 1);
+        q.y1 = q.y - rand_range(height / 2 + 1);
+        q.x2 = q.x + rand_range(width / 2 + 1);
+        q.y2 = q.y + rand_range(height / 2 + 1);
+        q.min_a = q.min_b = q.min_c = rand_range(10);
+        q.owner = rand_range(4) ? -1 : rand_range(SUPDEM_MAX_CLIENTS);
+        q.after = rand_range(4) ? -1 : rand_range(SUPDEM_MAX_SUPPLY);
+        int k = 1 + rand_range(64), min = rand_range(15);
+        int n = supdem_engine_query(es[0], SUPDEM_SUPPLY, &q, want);
+        int nk = supdem_engine_nearest(es[0], q.x, q.y, k, min, min, min, want + n);
+        for (int i = 1; i < count; i++) {
+            int m = supdem_engine_query(es[i], SUPDEM_SUPPLY, &q, got);
+            int mk = supdem_engine_nearest(es[i], q.x, q.y, k, min, min, min, got + m);
+            if (m != n || mk != nk || memcmp(want, got, (n + nk) * sizeof(int)) != 0) mismatches[i]++;
+        }
+    }
+
+    supdem_counts counts;
+    supdem_engine_counts(es[0], &counts);
+    printf("Conformance %dx%d, %d ops, seed %u, %d supplies at the end\n", width, height, ops, start_seed,
+           counts.supplies);
+    int failed = 0;
+    for (int i = 1; i < count; i++) {
+        printf("  %-9s %lu mismatches against linear\n", supdem_index_name(supdem_engine_index(es[i])), mismatches[i]);
+        failed |= mismatches[i] != 0;
+    }
+    for (int i = 0; i < count; i++) supdem_engine_destroy(es[i]);
+    free(want);
+    free(got);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [options]\n", prog_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -W width       Map width (default 1000)\n");
+    fprintf(stderr, "  -H height      Map height (default 1000)\n");
+    fprintf(stderr, "  -n ops         Timed operations per scenario (default 2000)\n");
+    fprintf(stderr, "  -s seed        Random seed (default 1)\n");
+    fprintf(stderr, "  -d dist        uniform or clustered (default both)\n");
+    fprintf(stderr, "  -r radius      Supply distance and list radius (default 8 and 64)\n");
+    fprintf(stderr, "  -f percent     Prefill level of the tables (default 10 and 50)\n");
+    fprintf(stderr, "  -m i:m:l       Operation mix insert:match:list (default 80:2:18)\n");
+    fprintf(stderr, "  -I index       Supply index: linear, grid, kdtree or quadtree (default %s)\n",
+            supdem_index_name(SUPDEM_INDEX_DEFAULT));
+    fprintf(stderr, "  -O             Soak the engine against its reference model instead\n");
+    fprintf(stderr, "  -C             Check that all supply indexes give the same results instead\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int dists[2] = { 0, 1 }, dist_count = 2;
+    int radii[2] = { 8, 64 }, radius_count = 2;
+    int fills[2] = { 10, 50 }, fill_count = 2;
+    int mix[OP_COUNT] = { 80, 2, 18 };
+    int oracle = 0, conformance = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "W:H:n:s:d:r:f:m:I:OC")) != -1) {
+        switch (opt) {
+        case 'W':
+            width = atoi(optarg);
+            break;
+        case 'H':
+            height = atoi(optarg);
+            break;
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if (strcmp(optarg, "uniform") == 0) dists[0] = 0;
+            else if (strcmp(optarg, "clustered") == 0) dists[0] = 1;
+            else usage(argv[0]);
+            dist_count = 1;
+            break;
+        case 'r':
+            radii[0] = atoi(optarg);
+            radius_count = 1;
+            break;
+        case 'f':
+            fills[0] = atoi(optarg);
+            fill_count = 1;
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &mix[OP_INSERT], &mix[OP_MATCH], &mix[OP_LIST]) != 3) usage(argv[0]);
+            break;
+        case 'I': {
+            int backend = supdem_index_lookup(optarg);
+            if (backend < 0) usage(argv[0]);
+            index_flags = SUPDEM_INDEX(backend);
+            break;
+        }
+        case 'O':
+            oracle = 1;
+            break;
+        case 'C':
+            conformance = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || width <= 0 || height <= 0 || ops <= 0 || fills[0] < 0 || fills[0] > 100 ||
+        mix[OP_INSERT] < 0 || mix[OP_MATCH] < 0 || mix[OP_LIST] < 0 ||
+        mix[OP_INSERT] + mix[OP_MATCH] + mix[OP_LIST] <= 0) {
+        usage(argv[0]);
+    }
+    if (oracle) return soak();
+    if (conformance) return conform();
+
+    llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    l1d_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                          PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    if (llc_fd < 0 || l1d_fd < 0) {
+        fprintf(stderr, "perf_event counters unavailable, cache misses not reported\n");
+    }
+
+    printf("Map %dx%d, %s index, %d ops per scenario, seed %u\n", width, height,
+           supdem_index_name(index_flags >> 8), ops, seed);
+    printf("  %-7s|%8s|%14s|%10s|%12s|%12s|\n", "Op", "Count", "ns/op", "allocs/op", "LLC miss/op", "L1D miss/op");
+    for (int d = 0; d < dist_count; d++) {
+        for (int r = 0; r < radius_count; r++) {
+            for (int f = 0; f < fill_count; f++) {
+                scenario sc = { dists[d], radii[r], fills[f], { mix[0], mix[1], mix[2] } };
+                run_scenario(&sc);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "supdem_engine.h"
+#include "supdem_oracle.h"
+
+#define MAX_ENTRIES (SUPDEM_MAX_SUPPLY > SUPDEM_MAX_DEMAND ? SUPDEM_MAX_SUPPLY : SUPDEM_MAX_DEMAND)
+
+// Spatial index: supplies are chained per cell x cell square of a dense
+// directory covering the map, demands queued per square in arrival order.
+// Cells start at GRID_CELL and grow for large maps so the directory stays
+// within GRID_MAX_CELLS.
+#define GRID_CELL 16
+#define GRID_MAX_CELLS (1 << 20)
+
+// Demand queue chunk: QUEUE_CHUNK slots fill a 64-byte line with the links
+#define QUEUE_CHUNK 12
+
+// Supply index backend of engines built without one in their flags
+#ifndef SUPDEM_DEFAULT_INDEX
+#define SUPDEM_DEFAULT_INDEX SUPDEM_INDEX_GRID
+#endif
+
+// k-d tree: node pool, and the depth past which it is rebuilt balanced
+#define KD_NODES (2 * SUPDEM_MAX_SUPPLY)
+#define KD_MAX_DEPTH 48
+
+// Quadtree: node pool, and supplies a leaf holds before it splits
+#define QUAD_NODES SUPDEM_MAX_SUPPLY
+#define QUAD_LEAF 8
+
+// Inserts remembered for the next match; more fall back to a full pass
+#define PENDING_MAX 256
+
+// Expiry timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_IDS (SUPDEM_MAX_SUPPLY + SUPDEM_MAX_DEMAND) // supplies, then demands
+
+typedef struct {
+    int x;
+    int y;
+    int client_id;
+    int radius;
+} watch_t;
+
+typedef struct {
+    int x;
+    int y;
+} position;
+
+typedef struct {
+    int next[MAX_ENTRIES];
+    int prev[MAX_ENTRIES];
+} grid_links;
+
+// Supplies are nodes of a 2-d tree splitting on x at even depths and y at
+// odd ones; left subtrees hold smaller keys. Removed supplies leave their
+// node as a router until the tree is rebuilt.
+typedef struct {
+    int root;
+    int used; // nodes taken from the pool
+    int dead; // of them whose supply went
+    int left[KD_NODES];
+    int right[KD_NODES];
+    int id[KD_NODES]; // supply slot, -1 once removed
+    int x[KD_NODES];
+    int y[KD_NODES];
+    int node_of[SUPDEM_MAX_SUPPLY];
+    int order[SUPDEM_MAX_SUPPLY]; // rebuild scratch
+} kd_tree;
+
+// Node 0 covers the map; a leaf chains its supplies and splits into four
+// quadrants (children, consecutive) once it holds more than QUAD_LEAF. The
+// quadrants of a node merge back when all four are empty leaves.
+typedef struct {
+    int used;      // nodes taken from the pool
+    int free_quad; // first of four freed nodes, chained through head
+    int child[QUAD_NODES]; // -1 for a leaf
+    int parent[QUAD_NODES];
+    int x1[QUAD_NODES], y1[QUAD_NODES], x2[QUAD_NODES], y2[QUAD_NODES];
+    int head[QUAD_NODES];
+    int size[QUAD_NODES];
+    int next[SUPDEM_MAX_SUPPLY];
+    int prev[SUPDEM_MAX_SUPPLY];
+    int leaf_of[SUPDEM_MAX_SUPPLY];
+} quad_tree;
+
+// Part of a cell's demand queue. Slots are appended at the tail and set to
+// -1 when their demand goes; a chunk returns to the pool once none is left.
+typedef struct {
+    int prev, next; // chunks of the same cell, oldest first
+    int used;       // slots filled so far
+    int live;       // of them still holding a demand
+    int ids[QUEUE_CHUNK];
+} queue_chunk;
+
+// A demand to try in a match, ordered by arrival
+typedef struct {
+    unsigned long seq;
+    int id;
+} match_candidate;
+
+// Hierarchical timer wheel for supply/demand TTLs. A timer lives in the
+// lowest level whose span covers its remaining ticks and is moved down a
+// level when that slot comes around; links are intrusive, so arming and
+// cancelling are O(1).
+typedef struct {
+    unsigned long now; // ticks processed
+    int head[TIMER_LEVELS][TIMER_SLOTS];
+    int next[TIMER_IDS];
+    int prev[TIMER_IDS];
+    int slot[TIMER_IDS];              // level * TIMER_SLOTS + slot
+    unsigned long expires[TIMER_IDS]; // 0 when not armed
+    unsigned long expired;
+} timer_wheel;
+
+struct supdem_engine {
+    int width;
+    int height;
+    int cell;
+    int cols;
+    int rows;
+
+    supdem_supply supplies[SUPDEM_MAX_SUPPLY];
+    supdem_demand demands[SUPDEM_MAX_DEMAND];
+    watch_t watches[SUPDEM_MAX_WATCH];
+    position positions[SUPDEM_MAX_CLIENTS];
+    int supply_count;
+    int demand_count;
+    int watch_count;
+
+    // Supply index; the grid backend keeps its heads in cells[]
+    int index;
+    union {
+        grid_links grid;
+        kd_tree kd;
+        quad_tree quad;
+    } idx;
+    timer_wheel timers;
+
+    // Demand queues, from a pool of as many chunks as demands: every chunk
+    // in use holds at least one
+    queue_chunk chunks[SUPDEM_MAX_DEMAND];
+    int free_chunk;
+    int demand_at[SUPDEM_MAX_DEMAND];            // chunk * QUEUE_CHUNK + slot
+    unsigned long demand_seq[SUPDEM_MAX_DEMAND]; // arrival order
+    unsigned long next_seq;
+
+    // Inserts since the last match as timer ids, so a match only looks at
+    // pairs they can form; pending_all when that is not enough
+    int pending[PENDING_MAX];
+    int pending_count;
+    int pending_all;
+    unsigned long match_seq;  // next_seq at the last match
+    int max_distance;         // no live supply reaches farther
+    match_candidate candidates[SUPDEM_MAX_DEMAND];
+
+    unsigned long event_head; // next event to drain
+    unsigned long event_tail;
+    unsigned long events_dropped;
+    supdem_event events[SUPDEM_EVENT_RING];
+
+    // Differential checking (SUPDEM_ORACLE): the reference model sits after
+    // the cells, oracle bytes from the start of the block
+    size_t oracle;
+    unsigned long oracle_mark;    // event_tail before the checked operation
+    unsigned long oracle_dropped; // events_dropped before it
+    unsigned long oracle_checks;
+    unsigned long oracle_divergences;
+    char oracle_report[256];
+
+    int cells[]; // cols * rows supply chain heads, demand queue heads, then tails
+};
+
+static void remove_supply(supdem_engine *e, int supply_id);
+static void remove_demand(supdem_engine *e, int demand_id);
+static void queue_reset(supdem_engine *e);
+static void index_reset(supdem_engine *e);
+static void timer_arm(supdem_engine *e, int id, unsigned long ticks);
+static void timer_cancel(supdem_engine *e, int id);
+
+static int manhattan_distance(int x1, int y1, int x2, int y2) {
+    return abs(x1 - x2) + abs(y1 - y2);
+}
+
+static int valid_size(int width, int height, int flags) {
+    return width > 0 && height > 0 && width <= SUPDEM_MAX_SIDE && height <= SUPDEM_MAX_SIDE &&
+           (flags >> 8) < SUPDEM_INDEX_COUNT;
+}
+
+static void grid_layout(int width, int height, int *cell, int *cols, int *rows) {
+    *cell = GRID_CELL;
+    while ((long)((width + *cell - 1) / *cell) * ((height + *cell - 1) / *cell) > GRID_MAX_CELLS) {
+        *cell *= 2;
+    }
+    *cols = (width + *cell - 1) / *cell;
+    *rows = (height + *cell - 1) / *cell;
+}
+
+// Offset of the reference model, just past the cells
+static size_t oracle_offset(int cols, int rows) {
+    size_t end = sizeof(supdem_engine) + 3 * (size_t)cols * rows * sizeof(int);
+    return (end + 63) & ~(size_t)63;
+}
+
+size_t supdem_engine_size(int width, int height, int flags) {
+    int cell, cols, rows;
+    if (!valid_size(width, height, flags)) return 0;
+    grid_layout(width, height, &cell, &cols, &rows);
+    if (flags & SUPDEM_ORACLE) return oracle_offset(cols, rows) + sizeof(oracle_state);
+    return sizeof(supdem_engine) + 3 * (size_t)cols * rows * sizeof(int);
+}
+
+supdem_engine *supdem_engine_init(void *mem, int width, int height, int flags) {
+    if (!valid_size(width, height, flags)) return NULL;
+    supdem_engine *e = mem;
+    memset(e, 0, sizeof(*e));
+    e->width = width;
+    e->height = height;
+    grid_layout(width, height, &e->cell, &e->cols, &e->rows);
+    e->index = flags >> 8 ? flags >> 8 : SUPDEM_DEFAULT_INDEX;
+    index_reset(e);
+    queue_reset(e);
+
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) e->supplies[i].client_id = -1;
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) e->demands[i].client_id = -1;
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) e->watches[i].client_id = -1;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int i = 0; i < TIMER_SLOTS; i++) e->timers.head[l][i] = -1;
+    }
+    if (flags & SUPDEM_ORACLE) {
+        e->oracle = oracle_offset(e->cols, e->rows);
+        oracle_init((oracle_state *)((char *)e + e->oracle), width, height);
+    }
+    return e;
+}
+
+supdem_engine *supdem_engine_create(int width, int height, int flags) {
+    size_t size = supdem_engine_size(width, height, flags);
+    if (size == 0) return NULL;
+    void *mem = malloc(size);
+    if (!mem) return NULL;
+    return supdem_engine_init(mem, width, height, flags);
+}
+
+void supdem_engine_destroy(supdem_engine *e) {
+    free(e);
+}
+
+static void emit(supdem_engine *e, const supdem_event *ev) {
+    if (e->event_tail - e->event_head == SUPDEM_EVENT_RING) {
+        e->events_dropped++;
+        return;
+    }
+    e->events[e->event_tail++ & (SUPDEM_EVENT_RING - 1)] = *ev;
+}
+
+// Queues a CHANGE event; called after an insert or update, before a remove
+static void emit_change(supdem_engine *e, char op, char kind, int index) {
+    supdem_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SUPDEM_EV_CHANGE;
+    ev.client_id = -1;
+    ev.op = op;
+    ev.kind = kind;
+    ev.index = index;
+    if (kind == 'S') ev.supply = e->supplies[index];
+    else ev.demand = e->demands[index];
+    emit(e, &ev);
+}
+
+int supdem_engine_drain(supdem_engine *e, supdem_event *out, int max) {
+    int n = 0;
+    while (n < max && e->event_head != e->event_tail) {
+        out[n++] = e->events[e->event_head++ & (SUPDEM_EVENT_RING - 1)];
+    }
+    return n;
+}
+
+// Reference model of an engine checked by an oracle, readied for the next
+// operation; NULL when checking is off
+static void oracle_resync(const supdem_engine *e, oracle_state *o);
+
+static oracle_state *oracle_begin(supdem_engine *e) {
+    if (!e->oracle) return NULL;
+    oracle_state *o = (oracle_state *)((char *)e + e->oracle);
+    o->event_count = 0;
+    e->oracle_mark = e->event_tail;
+    e->oracle_dropped = e->events_dropped;
+    return o;
+}
+
+static int event_cmp(const void *a, const void *b) {
+    const supdem_event *x = a, *y = b;
+    if (x->type != y->type) return x->type - y->type;
+    if (x->client_id != y->client_id) return x->client_id - y->client_id;
+    if (x->op != y->op) return x->op - y->op;
+    if (x->kind != y->kind) return x->kind - y->kind;
+    if (x->index != y->index) return x->index - y->index;
+    int r = memcmp(&x->supply, &y->supply, sizeof(x->supply));
+    return r ? r : memcmp(&x->demand, &y->demand, sizeof(x->demand));
+}
+
+static int describe_event(char *buf, size_t size, const supdem_event *ev) {
+    return snprintf(buf, size, "type %d op %c kind %c index %d client %d", ev->type,
+                    ev->op ? ev->op : '.', ev->kind ? ev->kind : '.', ev->index, ev->client_id);
+}
+
+// Compares what the engine did in the operation since oracle_begin() with
+// what the reference model did: the events queued (in order, or as a
+// multiset when ordered is 0) and the resulting tables. A divergence is
+// counted and described, and the reference model is resynchronized to the
+// engine so one fault is reported once.
+static void oracle_verify(supdem_engine *e, oracle_state *o, const char *op, int ordered) {
+    char what[192] = "";
+    int n = e->event_tail - e->oracle_mark;
+    e->oracle_checks++;
+
+    for (int i = 0; i < n; i++) o->scratch[i] = e->events[(e->oracle_mark + i) & (SUPDEM_EVENT_RING - 1)];
+    if (!ordered) {
+        qsort(o->scratch, n, sizeof(supdem_event), event_cmp);
+        qsort(o->events, o->event_count, sizeof(supdem_event), event_cmp);
+    }
+    // Events lost to a full queue cannot be compared
+    if (e->events_dropped == e->oracle_dropped) {
+        if (n != o->event_count) {
+            snprintf(what, sizeof(what), "%d events, reference %d", n, o->event_count);
+        }
+        for (int i = 0; i < n && !what[0]; i++) {
+            if (event_cmp(&o->scratch[i], &o->events[i]) != 0) {
+                int len = snprintf(what, sizeof(what), "event %d: ", i);
+                len += describe_event(what + len, sizeof(what) - len, &o->scratch[i]);
+                len += snprintf(what + len, sizeof(what) - len, ", reference ");
+                describe_event(what + len, sizeof(what) - len, &o->events[i]);
+            }
+        }
+    }
+
+    int supplies = 0, demands = 0, watches = 0;
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY && !what[0]; i++) {
+        const supdem_supply *s = &e->supplies[i], *r = &o->supplies[i];
+        if (memcmp(s, r, sizeof(*s)) != 0) {
+            snprintf(what, sizeof(what), "supply %d: (%d,%d) [%d,%d,%d] %d of %d, reference (%d,%d) [%d,%d,%d] %d of %d",
+                     i, s->x, s->y, s->a_amount, s->b_amount, s->c_amount, s->distance, s->client_id,
+                     r->x, r->y, r->a_amount, r->b_amount, r->c_amount, r->distance, r->client_id);
+        }
+        supplies += r->client_id != -1;
+    }
+    for (int i = 0; i < SUPDEM_MAX_DEMAND && !what[0]; i++) {
+        const supdem_demand *d = &e->demands[i], *r = &o->demands[i];
+        if (memcmp(d, r, sizeof(*d)) != 0) {
+            snprintf(what, sizeof(what), "demand %d: (%d,%d) [%d,%d,%d] of %d, reference (%d,%d) [%d,%d,%d] of %d",
+                     i, d->x, d->y, d->a_amount, d->b_amount, d->c_amount, d->client_id,
+                     r->x, r->y, r->a_amount, r->b_amount, r->c_amount, r->client_id);
+        }
+        if (!what[0] && r->client_id != -1 && e->demand_seq[i] != o->seq[i]) {
+            snprintf(what, sizeof(what), "demand %d arrived %lu, reference %lu", i, e->demand_seq[i], o->seq[i]);
+        }
+        demands += r->client_id != -1;
+    }
+    for (int i = 0; i < SUPDEM_MAX_WATCH && !what[0]; i++) {
+        const watch_t *w = &e->watches[i];
+        const oracle_watch *r = &o->watches[i];
+        if (w->client_id != r->client_id || w->x != r->x || w->y != r->y || w->radius != r->radius) {
+            snprintf(what, sizeof(what), "watch %d: %d at (%d,%d) radius %d, reference %d at (%d,%d) radius %d",
+                     i, w->client_id, w->x, w->y, w->radius, r->client_id, r->x, r->y, r->radius);
+        }
+        watches += r->client_id != -1;
+    }
+    for (int i = 0; i < SUPDEM_MAX_CLIENTS && !what[0]; i++) {
+        if (e->positions[i].x != o->positions[i][0] || e->positions[i].y != o->positions[i][1]) {
+            snprintf(what, sizeof(what), "client %d at (%d,%d), reference (%d,%d)", i,
+                     e->positions[i].x, e->positions[i].y, o->positions[i][0], o->positions[i][1]);
+        }
+    }
+    for (int i = 0; i < TIMER_IDS && !what[0]; i++) {
+        if (e->timers.expires[i] != o->expires[i]) {
+            snprintf(what, sizeof(what), "timer %d expires at %lu, reference %lu", i,
+                     e->timers.expires[i], o->expires[i]);
+        }
+    }
+    if (!what[0] && (e->supply_count != supplies || e->demand_count != demands || e->watch_count != watches)) {
+        snprintf(what, sizeof(what), "counts %d/%d/%d, reference %d/%d/%d", e->supply_count, e->demand_count,
+                 e->watch_count, supplies, demands, watches);
+    }
+    if (!what[0]) return;
+
+    e->oracle_divergences++;
+    snprintf(e->oracle_report, sizeof(e->oracle_report), "%s: %s", op, what);
+    oracle_resync(e, o);
+}
+
+// Makes the reference model a copy of the engine's tables
+static void oracle_resync(const supdem_engine *e, oracle_state *o) {
+    memcpy(o->supplies, e->supplies, sizeof(o->supplies));
+    memcpy(o->demands, e->demands, sizeof(o->demands));
+    memcpy(o->seq, e->demand_seq, sizeof(o->seq));
+    o->next_seq = e->next_seq;
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        o->watches[i].client_id = e->watches[i].client_id;
+        o->watches[i].x = e->watches[i].x;
+        o->watches[i].y = e->watches[i].y;
+        o->watches[i].radius = e->watches[i].radius;
+    }
+    for (int i = 0; i < SUPDEM_MAX_CLIENTS; i++) {
+        o->positions[i][0] = e->positions[i].x;
+        o->positions[i][1] = e->positions[i].y;
+    }
+    memcpy(o->expires, e->timers.expires, sizeof(o->expires));
+    o->now = e->timers.now;
+}
+
+int supdem_engine_oracle(const supdem_engine *e, supdem_oracle_status *st) {
+    if (!e->oracle) return -1;
+    st->checks = e->oracle_checks;
+    st->divergences = e->oracle_divergences;
+    memcpy(st->last, e->oracle_report, sizeof(st->last));
+    return 0;
+}
+
+static int *grid_heads(const supdem_engine *e) {
+    return (int *)e->cells;
+}
+
+// First and last chunk of each cell's demand queue
+static int *queue_heads(const supdem_engine *e) {
+    return (int *)e->cells + (size_t)e->cols * e->rows;
+}
+
+static int *queue_tails(const supdem_engine *e) {
+    return (int *)e->cells + 2 * (size_t)e->cols * e->rows;
+}
+
+// Cell of an in-bounds position
+static int grid_cell_of(const supdem_engine *e, int x, int y) {
+    return (y / e->cell) * e->cols + x / e->cell;
+}
+
+// Supply index backends. Each keeps the live supplies by the position in
+// their slot, which does not change while they are indexed, and visits
+// those inside a box, once each and in no particular order. Insert is
+// called once the slot is filled, remove before it is cleared.
+typedef void (*index_visit)(void *ctx, int id);
+
+static int in_box(const supdem_supply *s, int x1, int y1, int x2, int y2) {
+    return s->x >= x1 && s->x <= x2 && s->y >= y1 && s->y <= y2;
+}
+
+static void linear_reset(supdem_engine *e) {
+    (void)e;
+}
+
+static void linear_insert(supdem_engine *e, int id) {
+    (void)e;
+    (void)id;
+}
+
+static void linear_range(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx) {
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        const supdem_supply *s = &e->supplies[i];
+        if (s->client_id != -1 && in_box(s, x1, y1, x2, y2)) visit(ctx, i);
+    }
+}
+
+static void grid_reset(supdem_engine *e) {
+    for (size_t i = 0; i < (size_t)e->cols * e->rows; i++) grid_heads(e)[i] = -1;
+}
+
+static void grid_insert(supdem_engine *e, int id) {
+    grid_links *g = &e->idx.grid;
+    int *head = grid_heads(e);
+    int b = grid_cell_of(e, e->supplies[id].x, e->supplies[id].y);
+    g->prev[id] = -1;
+    g->next[id] = head[b];
+    if (head[b] != -1) g->prev[head[b]] = id;
+    head[b] = id;
+}
+
+static void grid_remove(supdem_engine *e, int id) {
+    grid_links *g = &e->idx.grid;
+    int *head = grid_heads(e);
+    int b = grid_cell_of(e, e->supplies[id].x, e->supplies[id].y);
+    if (g->prev[id] != -1) g->next[g->prev[id]] = g->next[id];
+    else head[b] = g->next[id];
+    if (g->next[id] != -1) g->prev[g->next[id]] = g->prev[id];
+}
+
+static void grid_range(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx) {
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > e->width - 1) x2 = e->width - 1;
+    if (y2 > e->height - 1) y2 = e->height - 1;
+    if (x1 > x2 || y1 > y2) return;
+    // More cells than slots: a plain scan is cheaper
+    if ((long)(x2 / e->cell - x1 / e->cell + 1) * (y2 / e->cell - y1 / e->cell + 1) > SUPDEM_MAX_SUPPLY) {
+        linear_range(e, x1, y1, x2, y2, visit, ctx);
+        return;
+    }
+    for (int cy = y1 / e->cell; cy <= y2 / e->cell; cy++) {
+        for (int cx = x1 / e->cell; cx <= x2 / e->cell; cx++) {
+            for (int i = grid_heads(e)[cy * e->cols + cx]; i != -1; i = e->idx.grid.next[i]) {
+                if (in_box(&e->supplies[i], x1, y1, x2, y2)) visit(ctx, i);
+            }
+        }
+    }
+}
+
+static void kd_reset(supdem_engine *e) {
+    e->idx.kd.root = -1;
+    e->idx.kd.used = 0;
+    e->idx.kd.dead = 0;
+}
+
+static int kd_key(const kd_tree *t, int node, int axis) {
+    return axis ? t->y[node] : t->x[node];
+}
+
+// Builds a balanced tree of nodes order[lo..hi), reusing them; the median
+// goes up, with every node of equal key to its right
+static int kd_build(kd_tree *t, int lo, int hi, int axis) {
+    if (lo >= hi) return -1;
+    int *o = t->order;
+    int mid = (lo + hi) / 2;
+    // Quickselect of the median
+    for (int l = lo, r = hi - 1; l < r;) {
+        int pivot = kd_key(t, o[(l + r) / 2], axis), i = l, j = r;
+        while (i <= j) {
+            while (kd_key(t, o[i], axis) < pivot) i++;
+            while (kd_key(t, o[j], axis) > pivot) j--;
+            if (i <= j) {
+                int tmp = o[i];
+                o[i++] = o[j];
+                o[j--] = tmp;
+            }
+        }
+        if (mid <= j) r = j;
+        else if (mid >= i) l = i;
+        else break;
+    }
+    // Keys equal to the median move from its left to just before it
+    int key = kd_key(t, o[mid], axis), split = mid;
+    for (int i = mid - 1; i >= lo; i--) {
+        if (kd_key(t, o[i], axis) == key) {
+            int tmp = o[i];
+            o[i] = o[--split];
+            o[split] = tmp;
+        }
+    }
+    int node = o[split];
+    t->left[node] = kd_build(t, lo, split, !axis);
+    t->right[node] = kd_build(t, split + 1, hi, !axis);
+    return node;
+}
+
+// Packs the nodes of live supplies at the start of the pool and rebuilds
+// the tree from them
+static void kd_rebuild(supdem_engine *e) {
+    kd_tree *t = &e->idx.kd;
+    int n = 0;
+    for (int node = 0; node < t->used; node++) {
+        if (t->id[node] == -1) continue;
+        t->id[n] = t->id[node];
+        t->x[n] = t->x[node];
+        t->y[n] = t->y[node];
+        t->node_of[t->id[n]] = n;
+        t->order[n] = n;
+        n++;
+    }
+    t->used = n;
+    t->dead = 0;
+    t->root = kd_build(t, 0, n, 0);
+}
+
+static void kd_insert(supdem_engine *e, int id) {
+    kd_tree *t = &e->idx.kd;
+    if (t->used == KD_NODES) kd_rebuild(e);
+    int node = t->used++;
+    t->id[node] = id;
+    t->x[node] = e->supplies[id].x;
+    t->y[node] = e->supplies[id].y;
+    t->left[node] = t->right[node] = -1;
+    t->node_of[id] = node;
+    if (t->root == -1) {
+        t->root = node;
+        return;
+    }
+    int depth = 0;
+    for (int p = t->root;; depth++) {
+        int *link = kd_key(t, node, depth & 1) < kd_key(t, p, depth & 1) ? &t->left[p] : &t->right[p];
+        if (*link == -1) {
+            *link = node;
+            break;
+        }
+        p = *link;
+    }
+    if (depth >= KD_MAX_DEPTH) kd_rebuild(e);
+}
+
+static void kd_remove(supdem_engine *e, int id) {
+    kd_tree *t = &e->idx.kd;
+    t->id[t->node_of[id]] = -1;
+    if (++t->dead > t->used / 2 && t->used > 64) kd_rebuild(e);
+}
+
+static void kd_visit(const kd_tree *t, int node, int axis, int x1, int y1, int x2, int y2,
+                     index_visit visit, void *ctx) {
+    while (node != -1) {
+        if (t->id[node] != -1 && t->x[node] >= x1 && t->x[node] <= x2 && t->y[node] >= y1 && t->y[node] <= y2) {
+            visit(ctx, t->id[node]);
+        }
+        int key = kd_key(t, node, axis);
+        int lo = axis ? y1 : x1, hi = axis ? y2 : x2;
+        if (lo < key) {
+            if (hi >= key) kd_visit(t, t->right[node], !axis, x1, y1, x2, y2, visit, ctx);
+            node = t->left[node];
+        } else {
+            node = t->right[node];
+        }
+        axis = !axis;
+    }
+}
+
+static void kd_range(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx) {
+    kd_visit(&e->idx.kd, e->idx.kd.root, 0, x1, y1, x2, y2, visit, ctx);
+}
+
+static void quad_reset(supdem_engine *e) {
+    quad_tree *t = &e->idx.quad;
+    t->used = 1;
+    t->free_quad = -1;
+    t->child[0] = -1;
+    t->parent[0] = -1;
+    t->x1[0] = 0;
+    t->y1[0] = 0;
+    t->x2[0] = e->width - 1;
+    t->y2[0] = e->height - 1;
+    t->head[0] = -1;
+    t->size[0] = 0;
+}
+
+// Quadrant of node holding (x, y): bit 0 for the right half, bit 1 for the lower
+static int quad_of(const quad_tree *t, int node, int x, int y) {
+    return (x > (t->x1[node] + t->x2[node]) / 2) | (y > (t->y1[node] + t->y2[node]) / 2) << 1;
+}
+
+static void quad_push(quad_tree *t, int leaf, int id) {
+    t->prev[id] = -1;
+    t->next[id] = t->head[leaf];
+    if (t->head[leaf] != -1) t->prev[t->head[leaf]] = id;
+    t->head[leaf] = id;
+    t->leaf_of[id] = leaf;
+    t->size[leaf]++;
+}
+
+// Splits a leaf into its quadrants, unless it is a single point or the
+// pool is exhausted
+static void quad_split(supdem_engine *e, int leaf) {
+    quad_tree *t = &e->idx.quad;
+    if (t->x1[leaf] == t->x2[leaf] && t->y1[leaf] == t->y2[leaf]) return;
+    int c = t->free_quad;
+    if (c != -1) {
+        t->free_quad = t->head[c];
+    } else if (t->used + 4 <= QUAD_NODES) {
+        c = t->used;
+        t->used += 4;
+    } else {
+        return;
+    }
+    int mx = (t->x1[leaf] + t->x2[leaf]) / 2, my = (t->y1[leaf] + t->y2[leaf]) / 2;
+    for (int q = 0; q < 4; q++) {
+        t->child[c + q] = -1;
+        t->parent[c + q] = leaf;
+        t->x1[c + q] = q & 1 ? mx + 1 : t->x1[leaf];
+        t->x2[c + q] = q & 1 ? t->x2[leaf] : mx;
+        t->y1[c + q] = q & 2 ? my + 1 : t->y1[leaf];
+        t->y2[c + q] = q & 2 ? t->y2[leaf] : my;
+        t->head[c + q] = -1;
+        t->size[c + q] = 0;
+    }
+    for (int id = t->head[leaf], next; id != -1; id = next) {
+        next = t->next[id];
+        quad_push(t, c + quad_of(t, leaf, e->supplies[id].x, e->supplies[id].y), id);
+    }
+    t->child[leaf] = c;
+    t->head[leaf] = -1;
+    t->size[leaf] = 0;
+}
+
+static void quad_insert(supdem_engine *e, int id) {
+    quad_tree *t = &e->idx.quad;
+    const supdem_supply *s = &e->supplies[id];
+    int node = 0;
+    while (t->child[node] != -1) node = t->child[node] + quad_of(t, node, s->x, s->y);
+    quad_push(t, node, id);
+    if (t->size[node] > QUAD_LEAF) quad_split(e, node);
+}
+
+static void quad_remove(supdem_engine *e, int id) {
+    quad_tree *t = &e->idx.quad;
+    int node = t->leaf_of[id];
+    if (t->prev[id] != -1) t->next[t->prev[id]] = t->next[id];
+    else t->head[node] = t->next[id];
+    if (t->next[id] != -1) t->prev[t->next[id]] = t->prev[id];
+    t->size[node]--;
+
+    // Four empty leaves make their parent a leaf again
+    while (node != 0) {
+        int p = t->parent[node], c = t->child[p];
+        for (int q = 0; q < 4; q++) {
+            if (t->child[c + q] != -1 || t->size[c + q] != 0) return;
+        }
+        t->child[p] = -1;
+        t->head[p] = -1;
+        t->size[p] = 0;
+        t->head[c] = t->free_quad;
+        t->free_quad = c;
+        node = p;
+    }
+}
+
+static void quad_visit(const supdem_engine *e, int node, int x1, int y1, int x2, int y2,
+                       index_visit visit, void *ctx) {
+    const quad_tree *t = &e->idx.quad;
+    if (t->x1[node] > x2 || t->x2[node] < x1 || t->y1[node] > y2 || t->y2[node] < y1) return;
+    if (t->x1[node] > t->x2[node] || t->y1[node] > t->y2[node]) return;
+    if (t->child[node] == -1) {
+        for (int id = t->head[node]; id != -1; id = t->next[id]) {
+            if (in_box(&e->supplies[id], x1, y1, x2, y2)) visit(ctx, id);
+        }
+        return;
+    }
+    for (int q = 0; q < 4; q++) quad_visit(e, t->child[node] + q, x1, y1, x2, y2, visit, ctx);
+}
+
+static void quad_range(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx) {
+    quad_visit(e, 0, x1, y1, x2, y2, visit, ctx);
+}
+
+typedef struct {
+    const char *name;
+    void (*reset)(supdem_engine *e);
+    void (*insert)(supdem_engine *e, int id);
+    void (*remove)(supdem_engine *e, int id);
+    void (*range)(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx);
+} index_ops;
+
+static const index_ops index_backends[SUPDEM_INDEX_COUNT] = {
+    [SUPDEM_INDEX_LINEAR] = { "linear", linear_reset, linear_insert, linear_insert, linear_range },
+    [SUPDEM_INDEX_GRID] = { "grid", grid_reset, grid_insert, grid_remove, grid_range },
+    [SUPDEM_INDEX_KDTREE] = { "kdtree", kd_reset, kd_insert, kd_remove, kd_range },
+    [SUPDEM_INDEX_QUADTREE] = { "quadtree", quad_reset, quad_insert, quad_remove, quad_range },
+};
+
+static void index_reset(supdem_engine *e) {
+    index_backends[e->index].reset(e);
+}
+
+static void index_insert(supdem_engine *e, int id) {
+    index_backends[e->index].insert(e, id);
+}
+
+static void index_remove(supdem_engine *e, int id) {
+    index_backends[e->index].remove(e, id);
+}
+
+static void index_range(const supdem_engine *e, int x1, int y1, int x2, int y2, index_visit visit, void *ctx) {
+    index_backends[e->index].range(e, x1, y1, x2, y2, visit, ctx);
+}
+
+const char *supdem_index_name(int backend) {
+    if (backend == SUPDEM_INDEX_DEFAULT) backend = SUPDEM_DEFAULT_INDEX;
+    return backend > 0 && backend < SUPDEM_INDEX_COUNT ? index_backends[backend].name : NULL;
+}
+
+int supdem_index_lookup(const char *name) {
+    for (int i = 1; i < SUPDEM_INDEX_COUNT; i++) {
+        if (strcmp(name, index_backends[i].name) == 0) return i;
+    }
+    return -1;
+}
+
+int supdem_engine_index(const supdem_engine *e) {
+    return e->index;
+}
+
+int supdem_engine_cell(const supdem_engine *e) {
+    return e->cell;
+}
+
+// Empties every demand queue and returns all chunks to the pool
+static void queue_reset(supdem_engine *e) {
+    size_t cells = (size_t)e->cols * e->rows;
+    for (size_t i = 0; i < cells; i++) {
+        queue_heads(e)[i] = -1;
+        queue_tails(e)[i] = -1;
+    }
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) e->chunks[i].next = i + 1 < SUPDEM_MAX_DEMAND ? i + 1 : -1;
+    e->free_chunk = 0;
+}
+
+// Appends demand id to the queue of the cell holding (x, y)
+static void queue_push(supdem_engine *e, int id, int x, int y) {
+    int b = grid_cell_of(e, x, y);
+    int *head = queue_heads(e), *tail = queue_tails(e);
+    int c = tail[b];
+    if (c == -1 || e->chunks[c].used == QUEUE_CHUNK) {
+        int n = e->free_chunk;
+        queue_chunk *q = &e->chunks[n];
+        e->free_chunk = q->next;
+        q->prev = c;
+        q->next = -1;
+        q->used = 0;
+        q->live = 0;
+        if (c != -1) e->chunks[c].next = n;
+        else head[b] = n;
+        tail[b] = n;
+        c = n;
+    }
+    queue_chunk *q = &e->chunks[c];
+    e->demand_at[id] = c * QUEUE_CHUNK + q->used;
+    q->ids[q->used++] = id;
+    q->live++;
+}
+
+static void queue_remove(supdem_engine *e, int id, int x, int y) {
+    int c = e->demand_at[id] / QUEUE_CHUNK;
+    queue_chunk *q = &e->chunks[c];
+    q->ids[e->demand_at[id] % QUEUE_CHUNK] = -1;
+    if (--q->live > 0) return;
+
+    int b = grid_cell_of(e, x, y);
+    if (q->prev != -1) e->chunks[q->prev].next = q->next;
+    else queue_heads(e)[b] = q->next;
+    if (q->next != -1) e->chunks[q->next].prev = q->prev;
+    else queue_tails(e)[b] = q->prev;
+    q->next = e->free_chunk;
+    e->free_chunk = c;
+}
+
+int supdem_engine_move(supdem_engine *e, int client_id, int x, int y) {
+    oracle_state *o = oracle_begin(e);
+    int ret = -1;
+    if (x >= 0 && x < e->width && y >= 0 && y < e->height) {
+        e->positions[client_id].x = x;
+        e->positions[client_id].y = y;
+        ret = 0;
+    }
+    if (o) {
+        oracle_move(o, client_id, x, y);
+        oracle_verify(e, o, "move", 1);
+    }
+    return ret;
+}
+
+void supdem_engine_position(const supdem_engine *e, int client_id, int *x, int *y) {
+    *x = e->positions[client_id].x;
+    *y = e->positions[client_id].y;
+}
+
+static void unwatch(supdem_engine *e, int client_id);
+
+void supdem_engine_remove_client(supdem_engine *e, int client_id) {
+    oracle_state *o = oracle_begin(e);
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        if (e->supplies[i].client_id == client_id) {
+            remove_supply(e, i);
+        }
+    }
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        if (e->demands[i].client_id == client_id) {
+            remove_demand(e, i);
+        }
+    }
+    unwatch(e, client_id);
+    e->positions[client_id].x = 0;
+    e->positions[client_id].y = 0;
+    if (o) {
+        oracle_remove_client(o, client_id);
+        oracle_verify(e, o, "remove client", 1);
+    }
+}
+
+// Remembers an insert, a supply slot or SUPDEM_MAX_SUPPLY + a demand slot,
+// for the next match
+static void add_pending(supdem_engine *e, int id) {
+    if (e->pending_count < PENDING_MAX) e->pending[e->pending_count++] = id;
+    else e->pending_all = 1;
+}
+
+static int insert_demand(supdem_engine *e, int client_id, int a, int b, int c, unsigned long ttl) {
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        if (e->demands[i].client_id == -1) {
+            supdem_demand *d = &e->demands[i];
+            d->x = e->positions[client_id].x;
+            d->y = e->positions[client_id].y;
+            d->client_id = client_id;
+            d->a_amount = a;
+            d->b_amount = b;
+            d->c_amount = c;
+            e->demand_count++;
+            e->demand_seq[i] = e->next_seq++;
+            queue_push(e, i, d->x, d->y);
+            if (ttl > 0) timer_arm(e, SUPDEM_MAX_SUPPLY + i, ttl);
+            add_pending(e, SUPDEM_MAX_SUPPLY + i);
+            emit_change(e, '+', 'D', i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int insert_supply(supdem_engine *e, int client_id, int distance, int a, int b, int c, unsigned long ttl) {
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        if (e->supplies[i].client_id == -1) {
+            supdem_supply *s = &e->supplies[i];
+            s->client_id = client_id;
+            s->x = e->positions[client_id].x;
+            s->y = e->positions[client_id].y;
+            s->a_amount = a;
+            s->b_amount = b;
+            s->c_amount = c;
+            s->distance = distance;
+            e->supply_count++;
+            if (distance > e->max_distance) e->max_distance = distance;
+            index_insert(e, i);
+            if (ttl > 0) timer_arm(e, i, ttl);
+            add_pending(e, i);
+            emit_change(e, '+', 'S', i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+int supdem_engine_insert_demand(supdem_engine *e, int client_id, int a, int b, int c, unsigned long ttl) {
+    oracle_state *o = oracle_begin(e);
+    int id = insert_demand(e, client_id, a, b, c, ttl);
+    if (o) {
+        oracle_insert_demand(o, client_id, a, b, c, ttl);
+        oracle_verify(e, o, "insert demand", 1);
+    }
+    return id;
+}
+
+int supdem_engine_insert_supply(supdem_engine *e, int client_id, int distance, int a, int b, int c, unsigned long ttl) {
+    oracle_state *o = oracle_begin(e);
+    int id = insert_supply(e, client_id, distance, a, b, c, ttl);
+    if (o) {
+        oracle_insert_supply(o, client_id, distance, a, b, c, ttl);
+        oracle_verify(e, o, "insert supply", 1);
+    }
+    return id;
+}
+
+static void remove_demand(supdem_engine *e, int demand_id) {
+    emit_change(e, '-', 'D', demand_id);
+    timer_cancel(e, SUPDEM_MAX_SUPPLY + demand_id);
+    e->demand_count--;
+    queue_remove(e, demand_id, e->demands[demand_id].x, e->demands[demand_id].y);
+    memset(&e->demands[demand_id], 0, sizeof(supdem_demand));
+    e->demands[demand_id].client_id = -1;
+}
+
+static void remove_supply(supdem_engine *e, int supply_id) {
+    emit_change(e, '-', 'S', supply_id);
+    timer_cancel(e, supply_id);
+    e->supply_count--;
+    index_remove(e, supply_id);
+    memset(&e->supplies[supply_id], 0, sizeof(supdem_supply));
+    e->supplies[supply_id].client_id = -1;
+}
+
+int supdem_engine_set_supply(supdem_engine *e, int id, const supdem_supply *s, unsigned long ttl) {
+    if (id < 0 || id >= SUPDEM_MAX_SUPPLY) return -1;
+    if (s && (s->client_id < 0 || s->client_id > SUPDEM_NO_OWNER ||
+              s->x < 0 || s->x >= e->width || s->y < 0 || s->y >= e->height)) {
+        return -1;
+    }
+    supdem_supply *slot = &e->supplies[id];
+    if (slot->client_id != -1) {
+        timer_cancel(e, id);
+        e->supply_count--;
+        index_remove(e, id);
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->client_id = -1;
+    if (s) {
+        *slot = *s;
+        e->supply_count++;
+        if (s->distance > e->max_distance) e->max_distance = s->distance;
+        index_insert(e, id);
+        if (ttl > 0) timer_arm(e, id, ttl);
+        e->pending_all = 1;
+    }
+    if (e->oracle) oracle_set_supply((oracle_state *)((char *)e + e->oracle), id, s, ttl);
+    return 0;
+}
+
+int supdem_engine_set_demand(supdem_engine *e, int id, const supdem_demand *d, unsigned long ttl) {
+    if (id < 0 || id >= SUPDEM_MAX_DEMAND) return -1;
+    if (d && (d->client_id < 0 || d->client_id > SUPDEM_NO_OWNER ||
+              d->x < 0 || d->x >= e->width || d->y < 0 || d->y >= e->height)) {
+        return -1;
+    }
+    supdem_demand *slot = &e->demands[id];
+    if (slot->client_id != -1) {
+        timer_cancel(e, SUPDEM_MAX_SUPPLY + id);
+        e->demand_count--;
+        queue_remove(e, id, slot->x, slot->y);
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->client_id = -1;
+    if (d) {
+        *slot = *d;
+        e->demand_count++;
+        e->demand_seq[id] = e->next_seq++;
+        queue_push(e, id, d->x, d->y);
+        if (ttl > 0) timer_arm(e, SUPDEM_MAX_SUPPLY + id, ttl);
+        e->pending_all = 1;
+    }
+    if (e->oracle) oracle_set_demand((oracle_state *)((char *)e + e->oracle), id, d, ttl);
+    return 0;
+}
+
+static int check_case_match(const supdem_engine *e, int demand_id, int supply_id) {
+    const supdem_supply *s = &e->supplies[supply_id];
+    const supdem_demand *d = &e->demands[demand_id];
+
+    if (d->client_id == -1 || s->client_id == -1) return 0;
+
+    int distance = manhattan_distance(d->x, d->y, s->x, s->y);
+
+    if (distance < s->distance && s->a_amount >= d->a_amount && s->b_amount >= d->b_amount && s->c_amount >= d->c_amount) {
+        return 1;
+    }
+    return 0;
+}
+
+static void match_demand_and_supply(supdem_engine *e, int demand_id, int supply_id) {
+    supdem_supply *s = &e->supplies[supply_id];
+    supdem_demand *d = &e->demands[demand_id];
+
+    supdem_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SUPDEM_EV_MATCH;
+    ev.client_id = -1;
+    ev.index = supply_id;
+    ev.supply = *s;
+    ev.demand = *d;
+    emit(e, &ev);
+
+    // Deduct from supply
+    s->a_amount -= d->a_amount;
+    s->b_amount -= d->b_amount;
+    s->c_amount -= d->c_amount;
+
+    remove_demand(e, demand_id);
+
+    // If supply exhausted
+    if (s->a_amount == 0 && s->b_amount == 0 && s->c_amount == 0) {
+        ev.type = SUPDEM_EV_EXHAUSTED;
+        ev.client_id = s->client_id;
+        ev.supply = *s;
+        emit(e, &ev);
+        remove_supply(e, supply_id);
+    } else {
+        emit_change(e, '~', 'S', supply_id);
+    }
+}
+
+static void sift_down(match_candidate *c, int i, int n) {
+    match_candidate v = c[i];
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && c[child + 1].seq > c[child].seq) child++;
+        if (c[child].seq <= v.seq) break;
+        c[i] = c[child];
+    }
+    c[i] = v;
+}
+
+// By arrival, in place: glibc's qsort may allocate for arrays this large
+static void sort_candidates(match_candidate *c, int n) {
+    for (int i = n / 2 - 1; i >= 0; i--) sift_down(c, i, n);
+    for (int i = n - 1; i > 0; i--) {
+        match_candidate t = c[0];
+        c[0] = c[i];
+        c[i] = t;
+        sift_down(c, 0, i);
+    }
+}
+
+static int add_candidate(supdem_engine *e, int demand_id, int *n) {
+    if (*n == SUPDEM_MAX_DEMAND) return -1;
+    e->candidates[*n].seq = e->demand_seq[demand_id];
+    e->candidates[(*n)++].id = demand_id;
+    return 0;
+}
+
+// Cells within reach of (x, y), clipped to the map; 0 when the box is empty
+static long reach_box(const supdem_engine *e, int x, int y, int reach, int *x1, int *y1, int *x2, int *y2) {
+    if (reach < 0) return 0;
+    *x1 = x - reach > 0 ? x - reach : 0;
+    *y1 = y - reach > 0 ? y - reach : 0;
+    *x2 = (long)x + reach < e->width ? x + reach : e->width - 1;
+    *y2 = (long)y + reach < e->height ? y + reach : e->height - 1;
+    return (long)(*x2 / e->cell - *x1 / e->cell + 1) * (*y2 / e->cell - *y1 / e->cell + 1);
+}
+
+// Adds the demands supply_id can serve, walking the queues of the cells it
+// reaches; -1 when the candidates are full
+static int add_served_demands(supdem_engine *e, int supply_id, int *n) {
+    const supdem_supply *s = &e->supplies[supply_id];
+    int x1, y1, x2, y2;
+    long cells = reach_box(e, s->x, s->y, s->distance - 1, &x1, &y1, &x2, &y2);
+    if (cells == 0) return 0;
+
+    if (cells > MAX_ENTRIES) {
+        for (int j = 0; j < SUPDEM_MAX_DEMAND; j++) {
+            if (check_case_match(e, j, supply_id) && add_candidate(e, j, n) < 0) return -1;
+        }
+        return 0;
+    }
+    for (int cy = y1 / e->cell; cy <= y2 / e->cell; cy++) {
+        for (int cx = x1 / e->cell; cx <= x2 / e->cell; cx++) {
+            for (int c = queue_heads(e)[cy * e->cols + cx]; c != -1; c = e->chunks[c].next) {
+                const queue_chunk *q = &e->chunks[c];
+                for (int k = 0; k < q->used; k++) {
+                    if (q->ids[k] != -1 && check_case_match(e, q->ids[k], supply_id) &&
+                        add_candidate(e, q->ids[k], n) < 0) {
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const supdem_engine *e;
+    int demand_id;
+    int best;
+} supply_search;
+
+static void offer_supply(void *ctx, int id) {
+    supply_search *s = ctx;
+    if ((s->best == -1 || id < s->best) && check_case_match(s->e, s->demand_id, id)) s->best = id;
+}
+
+// Lowest supply slot that can serve demand_id, or -1. With only_pending,
+// just the supplies inserted since the last match are tried.
+static int find_supply(const supdem_engine *e, int demand_id, int only_pending) {
+    if (only_pending) {
+        int best = -1;
+        for (int p = 0; p < e->pending_count; p++) {
+            int i = e->pending[p];
+            if (i < SUPDEM_MAX_SUPPLY && (best == -1 || i < best) && check_case_match(e, demand_id, i)) best = i;
+        }
+        return best;
+    }
+
+    const supdem_demand *d = &e->demands[demand_id];
+    int x1, y1, x2, y2;
+    long cells = reach_box(e, d->x, d->y, e->max_distance - 1, &x1, &y1, &x2, &y2);
+    if (cells == 0) return -1;
+    if (cells > MAX_ENTRIES) {
+        for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+            if (check_case_match(e, demand_id, i)) return i;
+        }
+        return -1;
+    }
+    supply_search search = { e, demand_id, -1 };
+    index_range(e, x1, y1, x2, y2, offer_supply, &search);
+    return search.best;
+}
+
+// Demands are served in arrival order, each by the lowest supply slot that
+// can. Only pairs formed by the inserts since the last match are possible,
+// so the candidates are the new demands and the old ones a new supply can
+// serve; when the inserts were not all remembered, every demand is.
+void supdem_engine_match(supdem_engine *e) {
+    oracle_state *o = oracle_begin(e);
+    int all = e->pending_all, n = 0;
+    for (int p = 0; p < e->pending_count && !all; p++) {
+        int id = e->pending[p];
+        if (id >= SUPDEM_MAX_SUPPLY) {
+            int j = id - SUPDEM_MAX_SUPPLY;
+            if (e->demands[j].client_id != -1 && add_candidate(e, j, &n) < 0) all = 1;
+        } else if (e->supplies[id].client_id != -1) {
+            if (add_served_demands(e, id, &n) < 0) all = 1;
+        }
+    }
+    if (all) {
+        n = 0;
+        for (int j = 0; j < SUPDEM_MAX_DEMAND; j++) {
+            if (e->demands[j].client_id != -1) add_candidate(e, j, &n);
+        }
+    }
+    sort_candidates(e->candidates, n);
+
+    for (int k = 0; k < n; k++) {
+        int j = e->candidates[k].id;
+        if (k > 0 && e->candidates[k - 1].seq == e->candidates[k].seq) continue;
+        if (e->demands[j].client_id == -1) continue;
+        int i = find_supply(e, j, !all && e->demand_seq[j] < e->match_seq);
+        if (i != -1) match_demand_and_supply(e, j, i);
+    }
+
+    if (all) {
+        e->max_distance = 0;
+        for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+            const supdem_supply *s = &e->supplies[i];
+            if (s->client_id != -1 && s->distance > e->max_distance) e->max_distance = s->distance;
+        }
+    }
+    e->pending_count = 0;
+    e->pending_all = 0;
+    e->match_seq = e->next_seq;
+    if (o) {
+        oracle_match(o);
+        oracle_verify(e, o, "match", 1);
+    }
+}
+
+void supdem_engine_announce(supdem_engine *e, int supply_id) {
+    oracle_state *o = oracle_begin(e);
+    const supdem_supply *s = &e->supplies[supply_id];
+    for (int i = 0; i < SUPDEM_MAX_WATCH && s->client_id != -1; i++) {
+        const watch_t *w = &e->watches[i];
+        if (w->client_id != -1 && w->radius > 0 && manhattan_distance(w->x, w->y, s->x, s->y) <= w->radius) {
+            supdem_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.type = SUPDEM_EV_WATCH;
+            ev.client_id = w->client_id;
+            ev.kind = 'S';
+            ev.index = supply_id;
+            ev.supply = *s;
+            emit(e, &ev);
+        }
+    }
+    if (o) {
+        oracle_announce(o, supply_id);
+        oracle_verify(e, o, "announce", 1);
+    }
+}
+
+void supdem_engine_watch(supdem_engine *e, int client_id, int radius) {
+    oracle_state *o = oracle_begin(e);
+    unwatch(e, client_id);
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (e->watches[i].client_id == -1) {
+            e->watches[i].client_id = client_id;
+            e->watches[i].x = e->positions[client_id].x;
+            e->watches[i].y = e->positions[client_id].y;
+            e->watches[i].radius = radius;
+            e->watch_count++;
+            break;
+        }
+    }
+    if (o) {
+        oracle_watch_client(o, client_id, radius);
+        oracle_verify(e, o, "watch", 1);
+    }
+}
+
+static void unwatch(supdem_engine *e, int client_id) {
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (e->watches[i].client_id == client_id) {
+            e->watches[i].client_id = -1;
+            e->watches[i].radius = 0;
+            e->watch_count--;
+        }
+    }
+}
+
+void supdem_engine_unwatch(supdem_engine *e, int client_id) {
+    oracle_state *o = oracle_begin(e);
+    unwatch(e, client_id);
+    if (o) {
+        oracle_unwatch(o, client_id);
+        oracle_verify(e, o, "unwatch", 1);
+    }
+}
+
+static void timer_link(supdem_engine *e, int id) {
+    timer_wheel *w = &e->timers;
+    unsigned long delta = w->expires[id] - w->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_SLOT_BITS * (level + 1))) level++;
+    int slot = (w->expires[id] >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+
+    w->slot[id] = level * TIMER_SLOTS + slot;
+    w->prev[id] = -1;
+    w->next[id] = w->head[level][slot];
+    if (w->next[id] != -1) w->prev[w->next[id]] = id;
+    w->head[level][slot] = id;
+}
+
+static void timer_unlink(supdem_engine *e, int id) {
+    timer_wheel *w = &e->timers;
+    if (w->prev[id] != -1) {
+        w->next[w->prev[id]] = w->next[id];
+    } else {
+        w->head[w->slot[id] / TIMER_SLOTS][w->slot[id] % TIMER_SLOTS] = w->next[id];
+    }
+    if (w->next[id] != -1) w->prev[w->next[id]] = w->prev[id];
+}
+
+// Expires timer id (a supply index, or SUPDEM_MAX_SUPPLY + a demand index)
+// after ticks ticks
+static void timer_arm(supdem_engine *e, int id, unsigned long ticks) {
+    timer_wheel *w = &e->timers;
+    if (ticks > SUPDEM_MAX_TTL) ticks = SUPDEM_MAX_TTL;
+    timer_cancel(e, id);
+    w->expires[id] = w->now + ticks;
+    timer_link(e, id);
+}
+
+static void timer_cancel(supdem_engine *e, int id) {
+    if (e->timers.expires[id] == 0) return;
+    timer_unlink(e, id);
+    e->timers.expires[id] = 0;
+}
+
+static void expire_entry(supdem_engine *e, int id) {
+    supdem_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SUPDEM_EV_EXPIRED;
+    if (id < SUPDEM_MAX_SUPPLY) {
+        ev.kind = 'S';
+        ev.index = id;
+        ev.supply = e->supplies[id];
+        ev.client_id = ev.supply.client_id;
+        emit(e, &ev);
+        remove_supply(e, id);
+    } else {
+        ev.kind = 'D';
+        ev.index = id - SUPDEM_MAX_SUPPLY;
+        ev.demand = e->demands[ev.index];
+        ev.client_id = ev.demand.client_id;
+        emit(e, &ev);
+        remove_demand(e, ev.index);
+    }
+    e->timers.expired++;
+}
+
+// Advances the wheel by one tick: slots of higher levels that come due are
+// redistributed downwards, then every timer of the current level-0 slot
+// expires
+static void timer_tick(supdem_engine *e) {
+    timer_wheel *w = &e->timers;
+    w->now++;
+
+    int levels = 1;
+    while (levels < TIMER_LEVELS && (w->now & ((1UL << (TIMER_SLOT_BITS * levels)) - 1)) == 0) levels++;
+    for (int level = levels - 1; level > 0; level--) {
+        int slot = (w->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+        int id = w->head[level][slot];
+        w->head[level][slot] = -1;
+        while (id != -1) {
+            int next = w->next[id];
+            timer_link(e, id);
+            id = next;
+        }
+    }
+
+    int slot = w->now & (TIMER_SLOTS - 1);
+    while (w->head[0][slot] != -1) {
+        expire_entry(e, w->head[0][slot]);
+    }
+}
+
+void supdem_engine_advance(supdem_engine *e, unsigned long now) {
+    oracle_state *o = oracle_begin(e);
+    while (e->timers.now < now) {
+        timer_tick(e);
+    }
+    // Entries due in the same tick expire in wheel order, which is not
+    // part of the contract
+    if (o) {
+        oracle_advance(o, now);
+        oracle_verify(e, o, "advance", 0);
+    }
+}
+
+const supdem_supply *supdem_engine_supply(const supdem_engine *e, int id) {
+    if (id < 0 || id >= SUPDEM_MAX_SUPPLY || e->supplies[id].client_id == -1) return NULL;
+    return &e->supplies[id];
+}
+
+const supdem_demand *supdem_engine_demand(const supdem_engine *e, int id) {
+    if (id < 0 || id >= SUPDEM_MAX_DEMAND || e->demands[id].client_id == -1) return NULL;
+    return &e->demands[id];
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Whether slot i of kind is live and satisfies q
+static int query_matches(const supdem_engine *e, int kind, int i, const supdem_query *q) {
+    int x, y, a, b, c, owner;
+    if (kind == SUPDEM_SUPPLY) {
+        const supdem_supply *s = &e->supplies[i];
+        x = s->x; y = s->y; a = s->a_amount; b = s->b_amount; c = s->c_amount; owner = s->client_id;
+    } else {
+        const supdem_demand *d = &e->demands[i];
+        x = d->x; y = d->y; a = d->a_amount; b = d->b_amount; c = d->c_amount; owner = d->client_id;
+    }
+    return owner != -1 && (q->owner == -1 || owner == q->owner) && i > q->after &&
+           x >= q->x1 && x <= q->x2 && y >= q->y1 && y <= q->y2 &&
+           (!q->near || manhattan_distance(q->x, q->y, x, y) <= q->radius) &&
+           a >= q->min_a && b >= q->min_b && c >= q->min_c;
+}
+
+typedef struct {
+    const supdem_engine *e;
+    const supdem_query *q;
+    int *out;
+    int n;
+} query_search;
+
+static void offer_query(void *ctx, int id) {
+    query_search *s = ctx;
+    if (query_matches(s->e, SUPDEM_SUPPLY, id, s->q)) s->out[s->n++] = id;
+}
+
+int supdem_engine_query(const supdem_engine *e, int kind, const supdem_query *q, int *out) {
+    int n = 0;
+
+    // Entries are always on the map, so only cells under the box are visited
+    int x1 = q->x1 > 0 ? q->x1 : 0;
+    int y1 = q->y1 > 0 ? q->y1 : 0;
+    int x2 = q->x2 < e->width - 1 ? q->x2 : e->width - 1;
+    int y2 = q->y2 < e->height - 1 ? q->y2 : e->height - 1;
+    if (x1 > x2 || y1 > y2) return 0;
+    long cells = (long)(x2 / e->cell - x1 / e->cell + 1) * (y2 / e->cell - y1 / e->cell + 1);
+
+    if (cells > MAX_ENTRIES) {
+        // More cells than entries: a plain scan is cheaper
+        int max = kind == SUPDEM_SUPPLY ? SUPDEM_MAX_SUPPLY : SUPDEM_MAX_DEMAND;
+        for (int i = q->after + 1 > 0 ? q->after + 1 : 0; i < max; i++) {
+            if (query_matches(e, kind, i, q)) out[n++] = i;
+        }
+        return n;
+    }
+    if (kind == SUPDEM_SUPPLY) {
+        query_search search = { e, q, out, 0 };
+        index_range(e, x1, y1, x2, y2, offer_query, &search);
+        n = search.n;
+    } else {
+        for (int cy = y1 / e->cell; cy <= y2 / e->cell; cy++) {
+            for (int cx = x1 / e->cell; cx <= x2 / e->cell; cx++) {
+                for (int c = queue_heads(e)[cy * e->cols + cx]; c != -1; c = e->chunks[c].next) {
+                    const queue_chunk *ch = &e->chunks[c];
+                    for (int k = 0; k < ch->used; k++) {
+                        if (ch->ids[k] != -1 && query_matches(e, kind, ch->ids[k], q)) out[n++] = ch->ids[k];
+                    }
+                }
+            }
+        }
+    }
+    qsort(out, n, sizeof(int), cmp_int);
+    return n;
+}
+
+// Whether supply i at distance d comes before out[j] in the k-nearest order
+static int nearer(const supdem_engine *e, int x, int y, int i, int d, int j) {
+    const supdem_supply *s = &e->supplies[j];
+    int dj = manhattan_distance(x, y, s->x, s->y);
+    return d < dj || (d == dj && i < j);
+}
+
+typedef struct {
+    const supdem_engine *e;
+    int x, y, k;
+    int min_a, min_b, min_c;
+    long radius; // only supplies this close count, -1 for any
+    int *out;
+    int n;
+} nearest_search;
+
+// Keeps supply id among the k nearest found so far, sorted nearest first
+static void offer_nearest(void *ctx, int id) {
+    nearest_search *ns = ctx;
+    const supdem_supply *s = &ns->e->supplies[id];
+    if (s->a_amount < ns->min_a || s->b_amount < ns->min_b || s->c_amount < ns->min_c) return;
+    int d = manhattan_distance(ns->x, ns->y, s->x, s->y);
+    if (ns->radius >= 0 && d > ns->radius) return;
+    if (ns->n == ns->k && !nearer(ns->e, ns->x, ns->y, id, d, ns->out[ns->k - 1])) return;
+    int j = ns->n < ns->k ? ns->n++ : ns->k - 1;
+    while (j > 0 && nearer(ns->e, ns->x, ns->y, id, d, ns->out[j - 1])) {
+        ns->out[j] = ns->out[j - 1];
+        j--;
+    }
+    ns->out[j] = id;
+}
+
+// Rings of cells around the one holding (x, y) are visited outwards. A
+// supply in ring r is at least (r - 1) * cell + 1 away, so the search stops
+// as soon as the k-th best found so far is no farther than that.
+static int grid_nearest(nearest_search *ns) {
+    const supdem_engine *e = ns->e;
+    const int *head = grid_heads(e);
+    int x = ns->x, y = ns->y, k = ns->k;
+    int *out = ns->out;
+
+    int cx = x / e->cell, cy = y / e->cell;
+    int max_r = cx > e->cols - 1 - cx ? cx : e->cols - 1 - cx;
+    if (cy > max_r) max_r = cy;
+    if (e->rows - 1 - cy > max_r) max_r = e->rows - 1 - cy;
+
+    for (int r = 0; r <= max_r; r++) {
+        if (ns->n == k && r > 0) {
+            const supdem_supply *s = &e->supplies[out[k - 1]];
+            if (manhattan_distance(x, y, s->x, s->y) <= (long)(r - 1) * e->cell) break;
+        }
+        for (int gy = cy - r; gy <= cy + r; gy++) {
+            if (gy < 0 || gy >= e->rows) continue;
+            // Inner rows of the ring only have its two side cells
+            int step = gy == cy - r || gy == cy + r ? 1 : 2 * r;
+            for (int gx = cx - r; gx <= cx + r; gx += step) {
+                if (gx < 0 || gx >= e->cols) continue;
+                for (int i = head[gy * e->cols + gx]; i != -1; i = e->idx.grid.next[i]) {
+                    offer_nearest(ns, i);
+                }
+            }
+        }
+    }
+    return ns->n;
+}
+
+// Any backend: boxes of doubling radius until the k nearest lie within one.
+// Every supply within the radius is seen, so k of them are the k nearest.
+int supdem_engine_nearest(const supdem_engine *e, int x, int y, int k, int min_a, int min_b, int min_c, int *out) {
+    nearest_search ns = { e, x, y, k, min_a, min_b, min_c, -1, out, 0 };
+    if (k <= 0 || x < 0 || x >= e->width || y < 0 || y >= e->height) return 0;
+    if (e->index == SUPDEM_INDEX_GRID) return grid_nearest(&ns);
+
+    for (long r = e->cell;; r *= 2) {
+        int all = x - r <= 0 && y - r <= 0 && x + r >= e->width - 1 && y + r >= e->height - 1;
+        ns.radius = all ? -1 : r;
+        ns.n = 0;
+        index_range(e, x - r, y - r, x + r > e->width ? e->width : x + r, y + r > e->height ? e->height : y + r,
+                    offer_nearest, &ns);
+        if (ns.n == k || all) return ns.n;
+    }
+}
+
+unsigned long supdem_engine_ttl(const supdem_engine *e, int kind, int id) {
+    unsigned long expires = e->timers.expires[kind == SUPDEM_SUPPLY ? id : SUPDEM_MAX_SUPPLY + id];
+    return expires ? expires - e->timers.now : 0;
+}
+
+unsigned long supdem_engine_arrival(const supdem_engine *e, int id) {
+    return e->demand_seq[id];
+}
+
+void supdem_engine_counts(const supdem_engine *e, supdem_counts *c) {
+    c->supplies = e->supply_count;
+    c->demands = e->demand_count;
+    c->watches = e->watch_count;
+    c->expired = e->timers.expired;
+    c->events_dropped = e->events_dropped;
+}
+
+void supdem_engine_repair(supdem_engine *e) {
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        supdem_supply *s = &e->supplies[i];
+        if (s->client_id == -1) continue;
+        if (s->client_id < 0 || s->client_id > SUPDEM_NO_OWNER ||
+            s->x < 0 || s->x >= e->width || s->y < 0 || s->y >= e->height) {
+            memset(s, 0, sizeof(*s));
+            s->client_id = -1;
+        }
+    }
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        supdem_demand *d = &e->demands[i];
+        if (d->client_id == -1) continue;
+        if (d->client_id < 0 || d->client_id > SUPDEM_NO_OWNER ||
+            d->x < 0 || d->x >= e->width || d->y < 0 || d->y >= e->height) {
+            memset(d, 0, sizeof(*d));
+            d->client_id = -1;
+        }
+    }
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (e->watches[i].client_id < -1 || e->watches[i].client_id >= SUPDEM_MAX_CLIENTS) {
+            e->watches[i].client_id = -1;
+            e->watches[i].radius = 0;
+        }
+    }
+    for (int i = 0; i < SUPDEM_MAX_CLIENTS; i++) {
+        position *p = &e->positions[i];
+        if (p->x < 0 || p->x >= e->width || p->y < 0 || p->y >= e->height) {
+            p->x = 0;
+            p->y = 0;
+        }
+    }
+
+    // Counts, grid chains and demand queues from the tables; the queues
+    // keep the recorded arrival order
+    e->supply_count = e->demand_count = e->watch_count = 0;
+    if (e->index <= SUPDEM_INDEX_DEFAULT || e->index >= SUPDEM_INDEX_COUNT) e->index = SUPDEM_DEFAULT_INDEX;
+    index_reset(e);
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        if (e->supplies[i].client_id == -1) continue;
+        e->supply_count++;
+        if (e->supplies[i].distance > e->max_distance) e->max_distance = e->supplies[i].distance;
+        index_insert(e, i);
+    }
+    queue_reset(e);
+    int n = 0;
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        if (e->demands[i].client_id == -1) continue;
+        e->demand_count++;
+        if (e->demand_seq[i] >= e->next_seq) e->next_seq = e->demand_seq[i] + 1;
+        add_candidate(e, i, &n);
+    }
+    sort_candidates(e->candidates, n);
+    for (int k = 0; k < n; k++) {
+        const supdem_demand *d = &e->demands[e->candidates[k].id];
+        queue_push(e, e->candidates[k].id, d->x, d->y);
+    }
+    e->pending_count = 0;
+    e->pending_all = 1;
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (e->watches[i].client_id != -1) e->watch_count++;
+    }
+
+    // Timer wheel from the deadlines of live entries; overdue ones expire
+    // on the next tick
+    timer_wheel *w = &e->timers;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int i = 0; i < TIMER_SLOTS; i++) w->head[l][i] = -1;
+    }
+    for (int id = 0; id < TIMER_IDS; id++) {
+        int live = id < SUPDEM_MAX_SUPPLY ? e->supplies[id].client_id != -1
+                                          : e->demands[id - SUPDEM_MAX_SUPPLY].client_id != -1;
+        if (!live) w->expires[id] = 0;
+        if (w->expires[id] == 0) continue;
+        if (w->expires[id] <= w->now) w->expires[id] = w->now + 1;
+        if (w->expires[id] - w->now > SUPDEM_MAX_TTL) w->expires[id] = w->now + SUPDEM_MAX_TTL;
+        timer_link(e, id);
+    }
+
+    if (e->event_tail - e->event_head > SUPDEM_EVENT_RING) e->event_head = e->event_tail - SUPDEM_EVENT_RING;
+    if (e->oracle) oracle_resync(e, (oracle_state *)((char *)e + e->oracle));
+}
@@ -0,0 +1,199 @@
+#ifndef SUPDEM_ENGINE_H
+#define SUPDEM_ENGINE_H
+
+#include <stddef.h>
+
+// Supply/demand matching engine: storage, spatial index, matching, watches
+// and TTL expiry, with no socket, thread or process dependencies. An engine
+// lives in one contiguous block without pointers, so it can be placed in
+// memory shared by several processes. It is not thread-safe; callers
+// serialize all calls on one engine.
+//
+// Operations never call back into the caller. Anything a client should hear
+// about (matches, watch hits, expiries, slot changes) is queued as a
+// supdem_event and handed over by supdem_engine_drain().
+
+#define SUPDEM_MAX_CLIENTS 1000
+#define SUPDEM_MAX_SUPPLY 10000
+#define SUPDEM_MAX_DEMAND 10000
+#define SUPDEM_MAX_WATCH 1000
+// Longest map side; keeps coordinates, distances and the grid in int
+#define SUPDEM_MAX_SIDE (1 << 20)
+
+// Owner of entries that belong to no client, e.g. restored from a snapshot.
+// Outside the client ids, so no client removes them or is told about them.
+#define SUPDEM_NO_OWNER SUPDEM_MAX_CLIENTS
+
+// Event queue capacity; one match queues at most four events, so draining
+// after every operation never overflows it
+#define SUPDEM_EVENT_RING 65536 // power of two
+
+// Longest TTL in ticks; longer ones are cut to it
+#define SUPDEM_MAX_TTL ((1UL << 24) - 1)
+
+// Engine flags
+#define SUPDEM_ORACLE 1 // check every operation against a reference model
+
+// Supply index backends, selected with SUPDEM_INDEX(backend) in the flags.
+// The default is SUPDEM_DEFAULT_INDEX, set when building supdem_engine.c
+// (grid unless overridden). All give the same results; they differ in cost
+// with the density and spread of the supplies.
+enum {
+    SUPDEM_INDEX_DEFAULT,
+    SUPDEM_INDEX_LINEAR,   // no index: every slot is scanned
+    SUPDEM_INDEX_GRID,     // chains per cell of a uniform grid
+    SUPDEM_INDEX_KDTREE,   // 2-d tree, rebuilt balanced when it degrades
+    SUPDEM_INDEX_QUADTREE, // point-region quadtree with bucketed leaves
+    SUPDEM_INDEX_COUNT
+};
+#define SUPDEM_INDEX(backend) ((backend) << 8)
+
+enum {
+    SUPDEM_SUPPLY,
+    SUPDEM_DEMAND
+};
+
+typedef struct supdem_engine supdem_engine;
+
+typedef struct {
+    int x;
+    int y;
+    int a_amount;
+    int b_amount;
+    int c_amount;
+    int distance;
+    int client_id;
+} supdem_supply;
+
+typedef struct {
+    int x;
+    int y;
+    int a_amount;
+    int b_amount;
+    int c_amount;
+    int client_id;
+} supdem_demand;
+
+enum {
+    SUPDEM_EV_MATCH,     // supply (before deduction) serves demand
+    SUPDEM_EV_EXHAUSTED, // supply used up by a match; client_id is its owner
+    SUPDEM_EV_WATCH,     // supply inserted within the radius of client_id's watch
+    SUPDEM_EV_EXPIRED,   // kind/index entry reached its TTL
+    SUPDEM_EV_CHANGE     // kind/index slot inserted ('+'), updated ('~') or removed ('-')
+};
+
+typedef struct {
+    int type;
+    int client_id; // recipient of MATCH is both owners, of CHANGE nobody
+    char op;
+    char kind;     // 'S' or 'D'
+    int index;
+    supdem_supply supply;
+    supdem_demand demand;
+} supdem_event;
+
+// Filters of a region query; entries must satisfy all of them
+typedef struct {
+    int x1, y1, x2, y2; // bounding box, inclusive
+    int near;           // also require Manhattan distance <= radius from (x, y)
+    int x, y, radius;
+    int min_a, min_b, min_c;
+    int owner;          // -1 for any
+    int after;          // only slots above this index
+} supdem_query;
+
+typedef struct {
+    int supplies;
+    int demands;
+    int watches;
+    unsigned long expired;
+    unsigned long events_dropped;
+} supdem_counts;
+
+typedef struct {
+    unsigned long checks;      // operations compared
+    unsigned long divergences;
+    char last[256];            // description of the latest divergence
+} supdem_oracle_status;
+
+// Bytes needed for a width x height map, and in-place initialization of a
+// block of that size. Returns 0 and NULL for an empty map or a side longer
+// than SUPDEM_MAX_SIDE.
+//
+// With SUPDEM_ORACLE the block also holds a reference model running the
+// original exhaustive algorithms: every operation is replayed on it and the
+// queued events and resulting tables are compared. Operations get several
+// times slower; meant for testing and soak runs.
+size_t supdem_engine_size(int width, int height, int flags);
+supdem_engine *supdem_engine_init(void *mem, int width, int height, int flags);
+supdem_engine *supdem_engine_create(int width, int height, int flags);
+void supdem_engine_destroy(supdem_engine *e);
+
+// Name of an index backend, and the backend of a name (-1 when unknown)
+const char *supdem_index_name(int backend);
+int supdem_index_lookup(const char *name);
+// Backend an engine was built with
+int supdem_engine_index(const supdem_engine *e);
+// Side of the square cells that bucket supplies and demand queues
+int supdem_engine_cell(const supdem_engine *e);
+
+// Client positions start at (0,0). Returns -1 when (x, y) is off the map.
+int supdem_engine_move(supdem_engine *e, int client_id, int x, int y);
+void supdem_engine_position(const supdem_engine *e, int client_id, int *x, int *y);
+// Drops every supply, demand and watch of client_id and resets its position
+void supdem_engine_remove_client(supdem_engine *e, int client_id);
+
+// Inserts at the client's position and returns the slot index, or -1 when
+// the table is full. ttl is in ticks, 0 for none. Inserting does not match;
+// call supdem_engine_match() once the inserts of an operation are done.
+int supdem_engine_insert_supply(supdem_engine *e, int client_id, int distance, int a, int b, int c, unsigned long ttl);
+int supdem_engine_insert_demand(supdem_engine *e, int client_id, int a, int b, int c, unsigned long ttl);
+// Stores an entry straight into slot id, replacing what was there, or
+// clears the slot when the entry is NULL. Queues no events and does not
+// match; for building copies of another engine's tables. The owner may be
+// SUPDEM_NO_OWNER. Returns -1 for a bad slot, owner or position.
+int supdem_engine_set_supply(supdem_engine *e, int id, const supdem_supply *s, unsigned long ttl);
+int supdem_engine_set_demand(supdem_engine *e, int id, const supdem_demand *d, unsigned long ttl);
+// Serves demands in arrival order, oldest first, each by the lowest supply
+// slot that can serve it; afterwards no demand can be served by any supply
+void supdem_engine_match(supdem_engine *e);
+// Queues watch events for a live supply
+void supdem_engine_announce(supdem_engine *e, int supply_id);
+
+// Replaces the client's watch with one of the given radius at its position
+void supdem_engine_watch(supdem_engine *e, int client_id, int radius);
+void supdem_engine_unwatch(supdem_engine *e, int client_id);
+
+// Moves the clock to tick now, expiring entries whose TTL ran out
+void supdem_engine_advance(supdem_engine *e, unsigned long now);
+
+// Live entry of a slot, or NULL
+const supdem_supply *supdem_engine_supply(const supdem_engine *e, int id);
+const supdem_demand *supdem_engine_demand(const supdem_engine *e, int id);
+// Stores the slots of kind that satisfy q into out (room for the table
+// size) in ascending order; returns their number
+int supdem_engine_query(const supdem_engine *e, int kind, const supdem_query *q, int *out);
+// Ticks left before a live entry expires, 0 when it has no TTL
+unsigned long supdem_engine_ttl(const supdem_engine *e, int kind, int id);
+// Arrival rank of a live demand; demands that arrived earlier rank lower.
+// Demands stored with supdem_engine_set_demand() arrive in call order.
+unsigned long supdem_engine_arrival(const supdem_engine *e, int id);
+// Stores into out (room for k) the k supplies nearest (x, y) in Manhattan
+// distance that hold at least the given amounts, nearest first and ties in
+// slot order; returns their number
+int supdem_engine_nearest(const supdem_engine *e, int x, int y, int k, int min_a, int min_b, int min_c, int *out);
+void supdem_engine_counts(const supdem_engine *e, supdem_counts *c);
+
+// Moves up to max queued events into out, oldest first; returns their number
+int supdem_engine_drain(supdem_engine *e, supdem_event *out, int max);
+
+// Rebuilds the counts, spatial index and timer wheel from the supply,
+// demand and watch tables, freeing entries that cannot be valid. For an
+// engine whose last operation was cut short, e.g. by a process that died
+// while holding the lock serializing calls.
+void supdem_engine_repair(supdem_engine *e);
+
+// Differential checking results; -1 when the engine runs without an oracle
+int supdem_engine_oracle(const supdem_engine *e, supdem_oracle_status *st);
+
+#endif
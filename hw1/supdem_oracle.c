@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "supdem_oracle.h"
+
+static int manhattan_distance(int x1, int y1, int x2, int y2) {
+    return abs(x1 - x2) + abs(y1 - y2);
+}
+
+static void emit(oracle_state *o, const supdem_event *ev) {
+    if (o->event_count < SUPDEM_EVENT_RING) {
+        o->events[o->event_count++] = *ev;
+    }
+}
+
+static void emit_change(oracle_state *o, char op, char kind, int index) {
+    supdem_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SUPDEM_EV_CHANGE;
+    ev.client_id = -1;
+    ev.op = op;
+    ev.kind = kind;
+    ev.index = index;
+    if (kind == 'S') ev.supply = o->supplies[index];
+    else ev.demand = o->demands[index];
+    emit(o, &ev);
+}
+
+void oracle_init(oracle_state *o, int width, int height) {
+    memset(o, 0, sizeof(*o));
+    o->width = width;
+    o->height = height;
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) o->supplies[i].client_id = -1;
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) o->demands[i].client_id = -1;
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) o->watches[i].client_id = -1;
+}
+
+int oracle_move(oracle_state *o, int client_id, int x, int y) {
+    if (x < 0 || x >= o->width || y < 0 || y >= o->height) return -1;
+    o->positions[client_id][0] = x;
+    o->positions[client_id][1] = y;
+    return 0;
+}
+
+static void remove_supply(oracle_state *o, int supply_id) {
+    emit_change(o, '-', 'S', supply_id);
+    memset(&o->supplies[supply_id], 0, sizeof(supdem_supply));
+    o->supplies[supply_id].client_id = -1;
+    o->expires[supply_id] = 0;
+}
+
+static void remove_demand(oracle_state *o, int demand_id) {
+    emit_change(o, '-', 'D', demand_id);
+    memset(&o->demands[demand_id], 0, sizeof(supdem_demand));
+    o->demands[demand_id].client_id = -1;
+    o->expires[SUPDEM_MAX_SUPPLY + demand_id] = 0;
+}
+
+void oracle_remove_client(oracle_state *o, int client_id) {
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        if (o->supplies[i].client_id == client_id) remove_supply(o, i);
+    }
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        if (o->demands[i].client_id == client_id) remove_demand(o, i);
+    }
+    oracle_unwatch(o, client_id);
+    o->positions[client_id][0] = 0;
+    o->positions[client_id][1] = 0;
+}
+
+static unsigned long deadline(oracle_state *o, unsigned long ttl) {
+    if (ttl == 0) return 0;
+    return o->now + (ttl > SUPDEM_MAX_TTL ? SUPDEM_MAX_TTL : ttl);
+}
+
+int oracle_insert_supply(oracle_state *o, int client_id, int distance, int a, int b, int c, unsigned long ttl) {
+    for (int i = 0; i < SUPDEM_MAX_SUPPLY; i++) {
+        if (o->supplies[i].client_id == -1) {
+            supdem_supply *s = &o->supplies[i];
+            s->client_id = client_id;
+            s->x = o->positions[client_id][0];
+            s->y = o->positions[client_id][1];
+            s->a_amount = a;
+            s->b_amount = b;
+            s->c_amount = c;
+            s->distance = distance;
+            o->expires[i] = deadline(o, ttl);
+            emit_change(o, '+', 'S', i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+int oracle_insert_demand(oracle_state *o, int client_id, int a, int b, int c, unsigned long ttl) {
+    for (int i = 0; i < SUPDEM_MAX_DEMAND; i++) {
+        if (o->demands[i].client_id == -1) {
+            supdem_demand *d = &o->demands[i];
+            d->x = o->positions[client_id][0];
+            d->y = o->positions[client_id][1];
+            d->client_id = client_id;
+            d->a_amount = a;
+            d->b_amount = b;
+            d->c_amount = c;
+            o->expires[SUPDEM_MAX_SUPPLY + i] = deadline(o, ttl);
+            o->seq[i] = o->next_seq++;
+            emit_change(o, '+', 'D', i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void oracle_set_supply(oracle_state *o, int id, const supdem_supply *s, unsigned long ttl) {
+    memset(&o->supplies[id], 0, sizeof(supdem_supply));
+    o->supplies[id].client_id = -1;
+    o->expires[id] = 0;
+    if (s) {
+        o->supplies[id] = *s;
+        o->expires[id] = deadline(o, ttl);
+    }
+}
+
+void oracle_set_demand(oracle_state *o, int id, const supdem_demand *d, unsigned long ttl) {
+    memset(&o->demands[id], 0, sizeof(supdem_demand));
+    o->demands[id].client_id = -1;
+    o->expires[SUPDEM_MAX_SUPPLY + id] = 0;
+    if (d) {
+        o->demands[id] = *d;
+        o->expires[SUPDEM_MAX_SUPPLY + id] = deadline(o, ttl);
+        o->seq[id] = o->next_seq++;
+    }
+}
+
+static int check_case_match(oracle_state *o, int demand_id, int supply_id) {
+    supdem_supply *s = &o->supplies[supply_id];
+    supdem_demand *d = &o->demands[demand_id];
+
+    if (d->client_id == -1 || s->client_id == -1) return 0;
+
+    int distance = manhattan_distance(d->x, d->y, s->x, s->y);
+
+    if (distance < s->distance && s->a_amount >= d->a_amount && s->b_amount >= d->b_amount && s->c_amount >= d->c_amount) {
+        return 1;
+    }
+    return 0;
+}
+
+static void match_demand_and_supply(oracle_state *o, int demand_id, int supply_id) {
+    supdem_supply *s = &o->supplies[supply_id];
+    supdem_demand *d = &o->demands[demand_id];
+
+    supdem_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SUPDEM_EV_MATCH;
+    ev.client_id = -1;
+    ev.index = supply_id;
+    ev.supply = *s;
+    ev.demand = *d;
+    emit(o, &ev);
+
+    s->a_amount -= d->a_amount;
+    s->b_amount -= d->b_amount;
+    s->c_amount -= d->c_amount;
+
+    remove_demand(o, demand_id);
+
+    if (s->a_amount == 0 && s->b_amount == 0 && s->c_amount == 0) {
+        ev.type = SUPDEM_EV_EXHAUSTED;
+        ev.client_id = s->client_id;
+        ev.supply = *s;
+        emit(o, &ev);
+        remove_supply(o, supply_id);
+    } else {
+        emit_change(o, '~', 'S', supply_id);
+    }
+}
+
+static int arrival_cmp(const void *a, const void *b) {
+    const oracle_arrival *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void oracle_match(oracle_state *o) {
+    int n = 0;
+    for (int j = 0; j < SUPDEM_MAX_DEMAND; j++) {
+        if (o->demands[j].client_id == -1) continue;
+        o->order[n].seq = o->seq[j];
+        o->order[n++].id = j;
+    }
+    qsort(o->order, n, sizeof(oracle_arrival), arrival_cmp);
+    for (int k = 0; k < n; k++) {
+        int j = o->order[k].id;
+        for (int i = 0; i < SUPDEM_MAX_SUPPLY && o->demands[j].client_id != -1; i++) {
+            if (o->supplies[i].client_id != -1 && check_case_match(o, j, i)) {
+                match_demand_and_supply(o, j, i);
+            }
+        }
+    }
+}
+
+void oracle_announce(oracle_state *o, int supply_id) {
+    supdem_supply *s = &o->supplies[supply_id];
+    if (s->client_id == -1) return;
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        oracle_watch *w = &o->watches[i];
+        if (w->client_id != -1 && w->radius > 0 && manhattan_distance(w->x, w->y, s->x, s->y) <= w->radius) {
+            supdem_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.type = SUPDEM_EV_WATCH;
+            ev.client_id = w->client_id;
+            ev.kind = 'S';
+            ev.index = supply_id;
+            ev.supply = *s;
+            emit(o, &ev);
+        }
+    }
+}
+
+void oracle_watch_client(oracle_state *o, int client_id, int radius) {
+    oracle_unwatch(o, client_id);
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (o->watches[i].client_id == -1) {
+            o->watches[i].client_id = client_id;
+            o->watches[i].x = o->positions[client_id][0];
+            o->watches[i].y = o->positions[client_id][1];
+            o->watches[i].radius = radius;
+            break;
+        }
+    }
+}
+
+void oracle_unwatch(oracle_state *o, int client_id) {
+    for (int i = 0; i < SUPDEM_MAX_WATCH; i++) {
+        if (o->watches[i].client_id == client_id) {
+            o->watches[i].client_id = -1;
+            o->watches[i].radius = 0;
+        }
+    }
+}
+
+void oracle_advance(oracle_state *o, unsigned long now) {
+    while (o->now < now) {
+        o->now++;
+        for (int id = 0; id < SUPDEM_MAX_SUPPLY + SUPDEM_MAX_DEMAND; id++) {
+            if (o->expires[id] != o->now) continue;
+            supdem_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.type = SUPDEM_EV_EXPIRED;
+            if (id < SUPDEM_MAX_SUPPLY) {
+                ev.kind = 'S';
+                ev.index = id;
+                ev.supply = o->supplies[id];
+                ev.client_id = ev.supply.client_id;
+                emit(o, &ev);
+                remove_supply(o, id);
+            } else {
+                ev.kind = 'D';
+                ev.index = id - SUPDEM_MAX_SUPPLY;
+                ev.demand = o->demands[ev.index];
+                ev.client_id = ev.demand.client_id;
+                emit(o, &ev);
+                remove_demand(o, ev.index);
+            }
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef SUPDEM_ORACLE_H
+#define SUPDEM_ORACLE_H
+
+#include "supdem_engine.h"
+
+// Reference model for differential checking of the engine (SUPDEM_ORACLE).
+// It keeps its own copy of the tables and runs exhaustive algorithms on
+// them: every demand in arrival order against every supply in slot order,
+// every watch scanned on insert, TTLs found by scanning for due deadlines.
+// Internal to the engine; it queues the events it would emit in events[].
+
+typedef struct {
+    int x;
+    int y;
+    int client_id;
+    int radius;
+} oracle_watch;
+
+typedef struct {
+    unsigned long seq;
+    int id;
+} oracle_arrival;
+
+typedef struct {
+    int width;
+    int height;
+    supdem_supply supplies[SUPDEM_MAX_SUPPLY];
+    supdem_demand demands[SUPDEM_MAX_DEMAND];
+    unsigned long seq[SUPDEM_MAX_DEMAND]; // arrival order of demands
+    unsigned long next_seq;
+    oracle_watch watches[SUPDEM_MAX_WATCH];
+    int positions[SUPDEM_MAX_CLIENTS][2];
+    unsigned long now;
+    unsigned long expires[SUPDEM_MAX_SUPPLY + SUPDEM_MAX_DEMAND]; // 0 when none
+
+    int event_count;
+    supdem_event events[SUPDEM_EVENT_RING];
+    supdem_event scratch[SUPDEM_EVENT_RING]; // engine events, for comparison
+    oracle_arrival order[SUPDEM_MAX_DEMAND]; // demands by arrival, for matching
+} oracle_state;
+
+void oracle_init(oracle_state *o, int width, int height);
+int oracle_move(oracle_state *o, int client_id, int x, int y);
+void oracle_remove_client(oracle_state *o, int client_id);
+int oracle_insert_supply(oracle_state *o, int client_id, int distance, int a, int b, int c, unsigned long ttl);
+int oracle_insert_demand(oracle_state *o, int client_id, int a, int b, int c, unsigned long ttl);
+void oracle_set_supply(oracle_state *o, int id, const supdem_supply *s, unsigned long ttl);
+void oracle_set_demand(oracle_state *o, int id, const supdem_demand *d, unsigned long ttl);
+void oracle_match(oracle_state *o);
+void oracle_announce(oracle_state *o, int supply_id);
+void oracle_watch_client(oracle_state *o, int client_id, int radius);
+void oracle_unwatch(oracle_state *o, int client_id);
+void oracle_advance(oracle_state *o, unsigned long now);
+
+#endif
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "supdemshm.h"
+
+// Attaches read-only to the shared state of a supdemserv started with -m and
+// prints who holds the global lock and for how long, table occupancy, the
+// deepest notification queues and the busiest cells of the map. It never
+// takes a lock, so it works on a stuck server and adds no load to a busy one.
+// The engine and client table are copied under the sequence lock of
+// shm->mutex; when the lock stays held throughout, the copy may be torn and
+// is reported as such.
+
+#define SEQ_TRIES 1000
+#define SEQ_RETRY_US 100
+
+static int top = 10;
+
+// What is copied of a client slot under the sequence lock
+typedef struct {
+    int client_id;
+    pid_t pid;
+    int worker;
+    int subscribed;
+    int queued; // read on its own, the queue is under the client's mutex
+} client_row;
+
+typedef struct {
+    int client_count;
+    int subscriber_count;
+    unsigned long version;
+    unsigned long lock_recoveries;
+    client_row clients[MAX_CLIENTS];
+} state_copy;
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void copy_tables(const shared_mem *shm, void *engine, state_copy *st) {
+    memcpy(engine, (const char *)shm + shm->engine_offset, shm->engine_size);
+    st->client_count = shm->client_count;
+    st->subscriber_count = shm->subscriber_count;
+    st->version = shm->version;
+    st->lock_recoveries = shm->lock_recoveries;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const client *cl = &shm->clients[i];
+        st->clients[i].client_id = cl->client_socket == -1 ? -1 : cl->client_id;
+        st->clients[i].pid = cl->pid;
+        st->clients[i].worker = cl->worker;
+        st->clients[i].subscribed = cl->subscribed;
+    }
+}
+
+// Copies the tables once no lock holder changed them meanwhile. Returns the
+// attempts it took, or 0 if every attempt overlapped a holder.
+static int copy_state(const shared_mem *shm, void *engine, state_copy *st) {
+    for (int tries = 1; tries <= SEQ_TRIES; tries++) {
+        unsigned long seq = __atomic_load_n(&shm->lock_seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            copy_tables(shm, engine, st);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shm->lock_seq, __ATOMIC_RELAXED) == seq) return tries;
+        }
+        usleep(SEQ_RETRY_US);
+    }
+    copy_tables(shm, engine, st);
+    return 0;
+}
+
+static void print_lock(const shared_mem *shm) {
+    unsigned long seq = __atomic_load_n(&shm->lock_seq, __ATOMIC_ACQUIRE);
+    pid_t pid = shm->lock_pid;
+    pid_t tid = shm->lock_tid;
+    int site = shm->lock_site;
+    unsigned long since = shm->lock_since_ns;
+
+    if (!(seq & 1) || pid == 0) {
+        printf("Lock: free, taken %lu times.\n", seq / 2);
+        return;
+    }
+    int dead = kill(pid, 0) < 0 && errno == ESRCH;
+    printf("Lock: held by pid %d (thread %d) at %s for %.3fs%s, taken %lu times.\n", pid, tid,
+           site >= 0 && site < SITE_COUNT ? site_names[site] : "?", (now_ns() - since) / 1e9,
+           dead ? ", holder is dead" : "", seq / 2 + 1);
+}
+
+static void print_commands(const shared_mem *shm) {
+    const char *sep = "";
+    printf("Commands:");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        unsigned long count = shm->retired.commands[c].count;
+        for (int i = 0; i < MAX_CLIENTS; i++) count += shm->stats[i].commands[c].count;
+        if (count) {
+            printf("%s %s %lu", sep, cmd_names[c], count);
+            sep = ",";
+        }
+    }
+    printf(".\n");
+}
+
+static int by_queued(const void *a, const void *b) {
+    const client_row *x = a, *y = b;
+    return y->queued - x->queued;
+}
+
+static void print_queues(const shared_mem *shm, state_copy *st) {
+    int n = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const client *cl = &shm->clients[i];
+        if (st->clients[i].client_id == -1) continue;
+        int head = __atomic_load_n(&cl->notif_head, __ATOMIC_RELAXED);
+        int tail = __atomic_load_n(&cl->notif_tail, __ATOMIC_RELAXED);
+        st->clients[n] = st->clients[i];
+        st->clients[n++].queued = (head - tail + MAX_NOTIFICATIONS) % MAX_NOTIFICATIONS;
+    }
+    qsort(st->clients, n, sizeof(client_row), by_queued);
+
+    printf("%7s|%8s|%7s|%11s|%7s|\n", "Client", "Pid", "Worker", "Subscribed", "Queued");
+    for (int i = 0; i < n && i < top; i++) {
+        const client_row *r = &st->clients[i];
+        printf("%7d|%8d|%7d|%11s|%7d|\n", r->client_id, r->pid, r->worker, r->subscribed ? "yes" : "no", r->queued);
+    }
+}
+
+// Cells holding the most supplies and demands, from the engine copy
+static void print_cells(const supdem_engine *e, int width, int height) {
+    int cell = supdem_engine_cell(e);
+    if (cell <= 0) return;
+    int cols = (width + cell - 1) / cell, rows = (height + cell - 1) / cell;
+    int *supplies = calloc((size_t)cols * rows, sizeof(int));
+    int *demands = calloc((size_t)cols * rows, sizeof(int));
+    if (!supplies || !demands) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    // A torn copy may hold garbage; entries off the map are skipped
+    for (int i = 0; i < MAX_SUPPLY; i++) {
+        const supdem_supply *s = supdem_engine_supply(e, i);
+        if (s && s->x >= 0 && s->x < width && s->y >= 0 && s->y < height) {
+            supplies[s->y / cell * cols + s->x / cell]++;
+        }
+    }
+    for (int i = 0; i < MAX_DEMAND; i++) {
+        const supdem_demand *d = supdem_engine_demand(e, i);
+        if (d && d->x >= 0 && d->x < width && d->y >= 0 && d->y < height) {
+            demands[d->y / cell * cols + d->x / cell]++;
+        }
+    }
+
+    printf("%15s|%15s|%9s|%9s|\n", "X", "Y", "Supplies", "Demands");
+    for (int k = 0; k < top; k++) {
+        int best = -1;
+        for (int c = 0; c < cols * rows; c++) {
+            if (supplies[c] + demands[c] > 0 &&
+                (best < 0 || supplies[c] + demands[c] > supplies[best] + demands[best])) {
+                best = c;
+            }
+        }
+        if (best < 0) break;
+        char xs[32], ys[32];
+        int x = best % cols * cell, y = best / cols * cell;
+        snprintf(xs, sizeof(xs), "%d-%d", x, x + cell - 1 < width - 1 ? x + cell - 1 : width - 1);
+        snprintf(ys, sizeof(ys), "%d-%d", y, y + cell - 1 < height - 1 ? y + cell - 1 : height - 1);
+        printf("%15s|%15s|%9d|%9d|\n", xs, ys, supplies[best], demands[best]);
+        supplies[best] = demands[best] = 0;
+    }
+    free(supplies);
+    free(demands);
+}
+
+static void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-n rows] <name>\n", prog_name);
+    fprintf(stderr, "  name           Shared memory object given to supdemserv -m\n");
+    fprintf(stderr, "  -n rows        Clients and cells listed (default %d)\n", top);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            top = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || top <= 0) usage(argv[0]);
+    const char *name = argv[optind];
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        exit(EXIT_FAILURE);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)sb.st_size < sizeof(shared_mem)) {
+        fprintf(stderr, "%s: not a supdemserv state\n", name);
+        exit(EXIT_FAILURE);
+    }
+    const shared_mem *shm = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        fprintf(stderr, "%s: not a supdemserv state, or the server is starting\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (shm->layout != sizeof(shared_mem) || shm->engine_offset + shm->engine_size > (size_t)sb.st_size) {
+        fprintf(stderr, "%s: written by a supdemserv with another layout\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    void *engine_mem = malloc(shm->engine_size);
+    state_copy *st = malloc(sizeof(state_copy));
+    if (!engine_mem || !st) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int tries = copy_state(shm, engine_mem, st);
+    const supdem_engine *e = engine_mem;
+
+    int running = kill(shm->server_pid, 0) == 0 || errno != ESRCH;
+    printf("Server pid %d%s, up %lus, map %dx%d, %s index.\n", shm->server_pid, running ? "" : " (exited)",
+           (now_ns() - shm->start_ns) / 1000000000UL, shm->width, shm->height,
+           supdem_index_name(supdem_engine_index(e)) ? supdem_index_name(supdem_engine_index(e)) : "?");
+    print_lock(shm);
+    if (tries) printf("Copy: consistent, %d attempts.\n", tries);
+    else printf("Copy: torn, the lock was held during all %d attempts.\n", SEQ_TRIES);
+
+    supdem_counts counts;
+    supdem_engine_counts(e, &counts);
+    printf("Tables: %d/%d supplies, %d/%d demands, %d/%d watches, %lu expired, %lu events dropped.\n",
+           counts.supplies, MAX_SUPPLY, counts.demands, MAX_DEMAND, counts.watches, MAX_WATCH,
+           counts.expired, counts.events_dropped);
+    printf("Clients: %d connected, %d subscribed, change feed at version %lu, %lu lock recoveries.\n",
+           st->client_count, st->subscriber_count, st->version, st->lock_recoveries);
+    print_commands(shm);
+    print_queues(shm, st);
+    print_cells(e, shm->width, shm->height);
+
+    free(engine_mem);
+    free(st);
+    return 0;
+}
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -13,116 +15,315 @@
 #include <pthread.h>
 #include <sys/un.h>
 #include <sys/mman.h>
-
-#define MAX_CLIENTS 1000
-#define MAX_SUPPLY 10000
-#define MAX_DEMAND 10000
-#define MAX_WATCH 1000
-#define MAX_NOTIFICATIONS 1000
+#include <sys/prctl.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "supdemtrace.h"
+#include "supdem_engine.h"
+#include "supdemshm.h"
+
+#define MAX_BATCH MAX_SUPPLY
+#define MAX_LISTENERS 8
+#define ACCEPT_BATCH 64
+#define OUT_BUF_SIZE 8192
+#define REPLY_BUF_MAX (16 << 20) // replies an event-loop client may leave unread
+#define NOTIFIER_THREADS 4 // per pre-fork worker
+
+// io_uring backend: recv buffers provided to the kernel for multishot receives
+#define URING_ENTRIES 256
+#define RECV_BUFS 256 // power of two
+#define RECV_BUF_SIZE 2048
+#define RECV_BGID 1
+
+enum {
+    BACKEND_THREADS,
+    BACKEND_EPOLL,
+    BACKEND_URING
+};
+
+// Longest a replica lags behind the change log
+#define REPLICA_POLL_MS 10
+
+// Most supplies a nearest query may ask for
+#define MAX_NEAREST 100
+
+// Engine clock tick driving TTL expiry
+#define TIMER_TICK_MS 100
+
+// Most trylock attempts on a busy shared mutex before parking in the kernel.
+// glibc never spins on robust mutexes, so lock_robust() does it, adapting
+// the spin to each mutex the way glibc's adaptive mutexes do.
+#define LOCK_SPINS 100
+
+// Snapshot file (-s): a header, then the live supplies in slot order and the
+// live demands in arrival order, each with its slot and the ticks left of
+// its TTL
+#define SNAPSHOT_MAGIC 0x53445331 // "SDS1"
 
 typedef struct {
-    int x;
-    int y;
-    int a_amount;
-    int b_amount;
-    int c_amount;
-    int distance;
-    int client_id;
-} supply;
+    unsigned int magic;
+    int width, height;
+    int supplies, demands;
+    unsigned long version; // change feed version the snapshot reflects
+} snapshot_header;
 
-typedef struct {
-    int x;
-    int y;
-    int a_amount;
-    int b_amount;
-    int c_amount;
-    int client_id;
-} demand;
+// A restored change feed continues this far past the snapshot's version, so
+// the versions the previous run reached after the snapshot are not reused
+#define SNAPSHOT_VERSION_GAP (1UL << 32)
 
 typedef struct {
-    int x;
-    int y;
-    int client_id;
-    int watch_id;
-} watch_t;
+    int index;
+    unsigned int ttl; // 0 for none
+    supdem_supply supply;
+} snapshot_supply;
 
 typedef struct {
-    char message[256];
-} notification;
+    int index;
+    unsigned int ttl;
+    supdem_demand demand;
+} snapshot_demand;
 
-typedef struct
-{
-    int client_id;
-    int x;
-    int y;
-    pthread_mutex_t mutex;
-    pthread_cond_t condition;
-    int client_socket;
-
-    // Notification queue
-    notification notifications[MAX_NOTIFICATIONS];
-    int notif_head;
-    int notif_tail;
-} client;
-
-typedef struct
-{
-    supply supplies[MAX_SUPPLY];
-    demand demands[MAX_DEMAND];
-    watch_t watches[MAX_WATCH];
-    pthread_mutex_t mutex;
-    client clients[MAX_CLIENTS];
-} shared_mem;
 
 typedef struct {
     int sockfd;
     int client_id;
 } thread_arg;
 
+// A listsupplies/listdemands query: engine filters plus a page size
+typedef struct {
+    supdem_query filter;
+    int limit; // 0 for no limit
+} list_query;
+
+// Records of a supplybatch/demandbatch being received by a command thread
+typedef struct {
+    int cmd; // CMD_SUPPLYBATCH, CMD_DEMANDBATCH or CMD_NONE when idle
+    int binary;
+    int count;
+    int received;
+    int failed;
+    int (*records)[4]; // distance (supplies only), a, b, c
+} batch_state;
+
 shared_mem *shm;
 
+// Matching engine, in a shared mapping next to shm. All calls hold
+// shm->mutex and are followed by dispatch_events().
+supdem_engine *engine;
+
+// Pre-fork workers: one eventfd per worker, created before the workers are
+// forked so that any of them can wake another when it queues a
+// notification for one of its clients
+int worker_efds[MAX_WORKERS];
+int my_worker = -1;
+
+// Event trace rings, one per client slot; NULL unless tracing is enabled
+trace_ring *traces;
+const char *trace_path;
+
+// Snapshot file; NULL unless snapshots are enabled
+const char *snapshot_path;
+
+// Per-client command rates by class; a rate of 0 is unlimited
+typedef struct {
+    double rate;  // tokens per second
+    double burst; // bucket size
+} rate_limit;
+
+rate_limit rate_limits[RATE_CLASSES];
+
+// Records of a batch per token drawn from the update bucket
+#define RATE_BATCH_RECORDS 64
+
+void usage(const char *prog_name);
+int open_listener(const char *endpoint, int reuseport);
+void accept_loop(int *listen_fds, int count, int prefork);
+void epoll_worker_loop(int *listen_fds, int count);
+void uring_worker_loop(int *listen_fds, int count);
+size_t take_notifications(int client_id, char *buf, size_t size);
 void client_agent(int childfd);
-int add_new_supply(int client_id, int distance, int a, int b, int c);
-void add_new_demand(int client_id, int a, int b, int c);
-void add_new_watch(int client_id, int new_watch_id);
-void remove_watch(int client_id);
+void *client_agent_thread(void *arg);
+void timer_loop();
+static unsigned long ttl_ticks(int ttl);
+void dispatch_events();
 void list_supplies(int client_id);
+int parse_list_query(int x, int y, char *args, list_query *q);
+void list_query_entries(int client_id, int kind, const list_query *q);
+void list_nearest(int client_id, int k, int a, int b, int c);
+void format_listing(FILE *out, const supdem_engine *e, int kind, const list_query *q);
+void replica_loop(char *endpoints, int width, int height);
+void record_change(const supdem_event *ev);
+int format_change(const change_event *e, char *buf, size_t size);
+void subscribe_client(int client_id, int has_version, unsigned long version);
+void unsubscribe_client(int client_id);
 void list_demands(int client_id);
+void list_cached(int client_id, int kind);
 void my_supplies(int client_id);
 void my_demands(int client_id);
-void move_client(int client_id, int x, int y);
-int check_for_match(int client_id);
-void check_for_watch_events_on_new_supply(int supply_index);
 void register_client(int *client_id, int sockfd);
-int manhattan_distance(int x1, int y1, int x2, int y2);
-int check_case_match(int demand_id, int supply_id);
-void match_demand_and_supply(int demand_id, int supply_id);
-void notify_client(int client_socket, const char *message);
+void send_reply(int fd, const char *buf, size_t len);
 void *command_thread_func(void *arg);
-void *notification_thread_func(void *args);
+int process_input(int client_id, int client_socket, char *buffer, size_t *buffer_len, batch_state *batch);
+int handle_command(int client_id, int client_socket, char *command, batch_state *batch);
+void start_batch(batch_state *batch, int cmd, int count, int binary);
+void add_batch_record(batch_state *batch, const char *line);
+size_t take_binary_records(batch_state *batch, const char *data, size_t len);
+void commit_batch(int client_id, int client_socket, batch_state *batch);
+void notifier_attach(int client_id, int sockfd);
+void notifier_detach(int client_id);
+void *notifier_thread_func(void *arg);
+shared_mem *map_shared_state(const char *name, size_t engine_size);
 void cleanup_shared_memory();
 void remove_client_resources(int client_id);
 void enqueue_notification(int client_id, const char *msg);
-void remove_demand(int demand_id);
-void remove_supply(int supply_id);
+int create_payload(const char *msg);
+void enqueue_payload(int client_id, int payload, const char *msg);
+void drop_notifications(int client_id);
+unsigned long now_ns();
+void record_latency(latency_hist *h, unsigned long ns);
+void merge_stats(stats_slot *dst, const stats_slot *src);
+void format_stats(FILE *out);
+void format_lock_stats(FILE *out);
+void send_report(int client_socket, void (*format)(FILE *));
+void init_robust_mutex(pthread_mutex_t *m);
+int lock_robust(pthread_mutex_t *m, int *spins, int *contended);
+void lock_client(int client_id);
+void recover_shared_state();
+void release_client(int client_id);
+void shm_lock(int site);
+void shm_unlock(stats_slot *st, int cmd);
+void trace_attach(int client_id);
+void trace_event(int type, int cmd, unsigned int arg);
+int dump_traces(const char *path);
+int save_snapshot(int client_id, const char *path);
+int rate_class(const char *command);
+int throttle(int client_id, int client_socket, int klass, double cost);
+void parse_rate(const char *arg, rate_limit *limit, const char *prog_name);
+void load_snapshot(const char *path, int width, int height);
+void stats_dump_loop(const char *path, int interval);
+
+void usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [options] <conn>[,<conn>...] <width> <height>\n", prog_name);
+    fprintf(stderr, "  conn           @path for a Unix socket, ip:port for TCP\n");
+    fprintf(stderr, "  width height   Map size, each side at most %d\n", SUPDEM_MAX_SIDE);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -a acceptors   Number of accepting processes, forking per connection (default 1)\n");
+    fprintf(stderr, "  -w workers     Pre-fork workers that accept and serve connections in threads (at most %d)\n", MAX_WORKERS);
+    fprintf(stderr, "  -b backend     Worker I/O: threads (default), epoll or uring event loop\n");
+    fprintf(stderr, "  -S statsfile   Periodically dump server statistics to statsfile\n");
+    fprintf(stderr, "  -i seconds     Stats dump interval (default 10)\n");
+    fprintf(stderr, "  -t tracefile   Enable event tracing; \"tracedump\" writes to tracefile\n");
+    fprintf(stderr, "  -I index       Supply index: linear, grid, kdtree or quadtree (default %s)\n",
+            supdem_index_name(SUPDEM_INDEX_DEFAULT));
+    fprintf(stderr, "  -O             Check every engine operation against a reference model\n");
+    fprintf(stderr, "  -R conn[,conn] Serve read-only listings from a replica process on conn\n");
+    fprintf(stderr, "  -s snapfile    Restore from snapfile at startup; \"bgsave\" writes it in the background\n");
+    fprintf(stderr, "  -m name        Keep the shared state in shared memory object name, for supdeminspect\n");
+    fprintf(stderr, "  -u rate[/burst] Updates per second allowed to each client (default unlimited)\n");
+    fprintf(stderr, "  -l rate[/burst] Listings, nearest, subscribe and bgsave per second per client\n");
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char** argv){
+    const char *shm_name = NULL;
+    const char *stats_path = NULL;
+    int stats_interval = 10;
+    int acceptors = 1;
+    int prefork = 0;
+    int backend = BACKEND_THREADS;
+    int engine_flags = 0;
+    char *replica_conn = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "S:i:t:a:w:b:I:OR:s:m:u:l:")) != -1) {
+        switch (opt) {
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'a':
+            acceptors = atoi(optarg);
+            break;
+        case 'w':
+            acceptors = atoi(optarg);
+            prefork = 1;
+            break;
+        case 'b':
+            if (strcmp(optarg, "threads") == 0) backend = BACKEND_THREADS;
+            else if (strcmp(optarg, "epoll") == 0) backend = BACKEND_EPOLL;
+            else if (strcmp(optarg, "uring") == 0) backend = BACKEND_URING;
+            else usage(argv[0]);
+            break;
+        case 'I': {
+            int index = supdem_index_lookup(optarg);
+            if (index < 0) usage(argv[0]);
+            engine_flags |= SUPDEM_INDEX(index);
+            break;
+        }
+        case 'O':
+            engine_flags |= SUPDEM_ORACLE;
+            break;
+        case 'R':
+            replica_conn = optarg;
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'u':
+            parse_rate(optarg, &rate_limits[RATE_UPDATE], argv[0]);
+            break;
+        case 'l':
+            parse_rate(optarg, &rate_limits[RATE_LISTING], argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    int acceptfd;
-    
-    shm = mmap(NULL, sizeof(shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (shm == MAP_FAILED) {
-        perror("mmap");
-        exit(EXIT_FAILURE);
+    if (argc - optind != 3 || stats_interval <= 0 || acceptors <= 0) {
+        usage(argv[0]);
+    }
+    if (backend != BACKEND_THREADS && !prefork) {
+        usage(argv[0]);
+    }
+    // Every pre-fork worker has a doorbell, whatever the backend
+    if (prefork && acceptors > MAX_WORKERS) {
+        usage(argv[0]);
     }
 
-    memset(shm, 0, sizeof(shared_mem));
+    // A client that disconnects mid-reply must not kill a process serving others
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *conn = argv[optind];
+    char *width_end, *height_end;
+    errno = 0;
+    long width = strtol(argv[optind + 1], &width_end, 10);
+    long height = strtol(argv[optind + 2], &height_end, 10);
+    if (errno == ERANGE || *width_end != '\0' || *height_end != '\0' ||
+        width <= 0 || height <= 0 || width > SUPDEM_MAX_SIDE || height > SUPDEM_MAX_SIDE) {
+        usage(argv[0]);
+    }
+    size_t engine_size = supdem_engine_size(width, height, engine_flags);
+    if (engine_size == 0) {
+        usage(argv[0]);
+    }
+    shm = map_shared_state(shm_name, engine_size);
 
-    pthread_mutexattr_t mattr;
-    pthread_mutexattr_init(&mattr);
-    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shm->mutex, &mattr);
-    pthread_mutexattr_destroy(&mattr);
+    init_robust_mutex(&shm->mutex);
 
     signal(SIGCHLD, SIG_IGN);
 
@@ -132,48 +333,159 @@ int main(int argc, char** argv){
         shm->clients[i].notif_head = 0;
         shm->clients[i].notif_tail = 0;
 
-        pthread_mutexattr_t cattr;
         pthread_condattr_t condattr;
-        pthread_mutexattr_init(&cattr);
         pthread_condattr_init(&condattr);
-        pthread_mutexattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
         pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
-        pthread_mutex_init(&shm->clients[i].mutex, &cattr);
+        init_robust_mutex(&shm->clients[i].mutex);
         pthread_cond_init(&shm->clients[i].condition, &condattr);
-        pthread_mutexattr_destroy(&cattr);
         pthread_condattr_destroy(&condattr);
     }
 
-    for (int i=0; i<MAX_DEMAND; i++){
-        shm->demands[i].client_id = -1;
+    shm->start_ns = now_ns();
+
+    engine = supdem_engine_init((char *)shm + shm->engine_offset, width, height, engine_flags);
+    shm->width = width;
+    shm->height = height;
+    if (snapshot_path) {
+        load_snapshot(snapshot_path, width, height);
+    }
+    // Last, so an inspector attaching meanwhile sees no half-built state
+    __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    if (trace_path) {
+        // Pages are only touched by rings that are actually used
+        traces = mmap(NULL, sizeof(trace_ring) * MAX_CLIENTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (traces == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Before any fork: the timer process queues expiry notifications too
+    if (prefork) {
+        for (int a = 0; a < acceptors; a++) {
+            worker_efds[a] = eventfd(0, EFD_CLOEXEC);
+            if (worker_efds[a] < 0) {
+                perror("eventfd");
+                exit(EXIT_FAILURE);
+            }
+        }
     }
-    for (int i=0; i<MAX_SUPPLY; i++) shm->supplies[i].client_id = -1;
-    for (int i=0; i<MAX_WATCH; i++) shm->watches[i].client_id = -1;
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <conn> <width> <height>\n", argv[0]);
+    pid_t timer_pid = fork();
+    if (timer_pid < 0) {
+        perror("fork");
         exit(EXIT_FAILURE);
     }
+    if (timer_pid == 0) {
+        timer_loop();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (replica_conn) {
+        shm->replica_enabled = 1;
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            replica_loop(replica_conn, width, height);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (stats_path) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            stats_dump_loop(stats_path, stats_interval);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    // conn is a comma-separated list of endpoints: @path for a Unix socket,
+    // ip:port for TCP
+    char *endpoints[MAX_LISTENERS];
+    int endpoint_count = 0;
+    char *conn_copy = strdup(conn);
+    char *save;
+    for (char *tok = strtok_r(conn_copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (endpoint_count == MAX_LISTENERS) {
+            fprintf(stderr, "Too many endpoints (max %d)\n", MAX_LISTENERS);
+            exit(EXIT_FAILURE);
+        }
+        endpoints[endpoint_count++] = tok;
+    }
+    if (endpoint_count == 0) {
+        usage(argv[0]);
+    }
+
+    // Unix sockets cannot be load-balanced by the kernel, so all acceptors
+    // share one listening socket per path. TCP endpoints are opened by each
+    // acceptor with SO_REUSEPORT and the kernel spreads connections.
+    int listen_fds[MAX_LISTENERS];
+    for (int i = 0; i < endpoint_count; i++) {
+        if (endpoints[i][0] == '@') {
+            listen_fds[i] = open_listener(endpoints[i], 0);
+        }
+    }
+
+    for (int a = 0; a < acceptors; a++) {
+        pid_t pid = a == acceptors - 1 ? 0 : fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            // The last acceptor is the parent itself
+            if (a != acceptors - 1) {
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+            }
+            for (int i = 0; i < endpoint_count; i++) {
+                if (endpoints[i][0] != '@') {
+                    listen_fds[i] = open_listener(endpoints[i], acceptors > 1);
+                }
+            }
+            if (prefork) {
+                my_worker = a;
+            }
+            if (backend == BACKEND_THREADS) {
+                accept_loop(listen_fds, endpoint_count, prefork);
+            }
+            if (backend == BACKEND_URING) {
+                uring_worker_loop(listen_fds, endpoint_count);
+            }
+            epoll_worker_loop(listen_fds, endpoint_count);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(conn_copy);
+    cleanup_shared_memory();
+}
 
-    const char *conn = argv[1];
-    // width and height not directly used
-    int width = atoi(argv[2]);
-    int height = atoi(argv[3]);
+// Binds and listens on one endpoint. Listening sockets are non-blocking so
+// the accept loop can drain a burst of connections after a single wakeup.
+int open_listener(const char *endpoint, int reuseport) {
+    int acceptfd;
+    int opt = 1;
 
-    if(conn[0] == '@'){
+    if(endpoint[0] == '@'){
         struct sockaddr_un serv_addr_unix;
         memset(&serv_addr_unix, 0, sizeof(struct sockaddr_un));
         serv_addr_unix.sun_family = AF_UNIX;
-        strncpy(serv_addr_unix.sun_path, conn+1, sizeof(serv_addr_unix.sun_path)-1);
+        strncpy(serv_addr_unix.sun_path, endpoint+1, sizeof(serv_addr_unix.sun_path)-1);
         serv_addr_unix.sun_path[sizeof(serv_addr_unix.sun_path)-1] = '\0';
-        acceptfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        acceptfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
         if(acceptfd < 0){
             perror("socket");
             exit(EXIT_FAILURE);
         }
         unlink(serv_addr_unix.sun_path);    
 
-        int opt = 1;
         if (setsockopt(acceptfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
             perror("setsockopt");
             close(acceptfd);
@@ -183,33 +495,12 @@ int main(int argc, char** argv){
             perror("bind");
             exit(EXIT_FAILURE);
         }
-
-        listen(acceptfd, SOMAXCONN);
-        while(1){
-            int childfd = accept(acceptfd, NULL, NULL);
-            if(childfd < 0){
-                perror("accept");
-                exit(EXIT_FAILURE);
-            }
-            pid_t pid = fork();
-            if(pid== 0){
-                close(acceptfd);
-                client_agent(childfd);
-                close(childfd);
-                exit(EXIT_SUCCESS);
-
-            } else {
-                close(childfd);
-            }
-
-        }
-        
     } else {
         struct sockaddr_in serv_addr;
         memset(&serv_addr, 0, sizeof(struct sockaddr_in));
 
         char conn_copy[256];
-        strncpy(conn_copy, conn, sizeof(conn_copy)-1);
+        strncpy(conn_copy, endpoint, sizeof(conn_copy)-1);
         conn_copy[sizeof(conn_copy)-1] = '\0';
 
         char *ip = strtok(conn_copy, ":");
@@ -224,121 +515,763 @@ int main(int argc, char** argv){
         serv_addr.sin_family = AF_INET;
         serv_addr.sin_addr.s_addr = inet_addr(ip);
 
-        acceptfd = socket(AF_INET, SOCK_STREAM, 0);
+        acceptfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
         if(acceptfd < 0){
             perror("socket");
             exit(EXIT_FAILURE);
         }
-        int opt = 1;
         if (setsockopt(acceptfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
             perror("setsockopt");
             close(acceptfd);
             exit(EXIT_FAILURE);
         }
+        if (reuseport && setsockopt(acceptfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt");
+            close(acceptfd);
+            exit(EXIT_FAILURE);
+        }
        
         if(bind(acceptfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0){
             perror("bind");
             exit(EXIT_FAILURE);
         }
+    }
+
+    if (listen(acceptfd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return acceptfd;
+}
 
-        listen(acceptfd, SOMAXCONN);
+// Waits on all listening sockets and forks an agent per accepted connection,
+// or with prefork runs the agent in a thread of this long-lived worker.
+// Each wakeup accepts up to ACCEPT_BATCH pending connections per socket.
+void accept_loop(int *listen_fds, int count, int prefork) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    struct pollfd pfds[MAX_LISTENERS];
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = listen_fds[i];
+        pfds[i].events = POLLIN;
+    }
 
-        while(1){
-            int childfd = accept(acceptfd, NULL, NULL);
-            if(childfd < 0){
-                perror("accept");
-                exit(EXIT_FAILURE);
+    while(1){
+        if (poll(pfds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            for (int n = 0; n < ACCEPT_BATCH; n++) {
+                int childfd = accept4(listen_fds[i], NULL, NULL, SOCK_CLOEXEC);
+                if(childfd < 0){
+                    // Another acceptor may have taken it, or the burst is drained
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+                        perror("accept");
+                    }
+                    break;
+                }
+
+                if (prefork) {
+                    pthread_t agent;
+                    if (pthread_create(&agent, &attr, client_agent_thread, (void *)(long)childfd) != 0) {
+                        perror("pthread_create");
+                        close(childfd);
+                    }
+                    continue;
+                }
+
+                pid_t pid = fork();
+                if(pid == 0){
+                    for (int j = 0; j < count; j++) {
+                        close(listen_fds[j]);
+                    }
+                    client_agent(childfd);
+                    close(childfd);
+                    exit(EXIT_SUCCESS);
+                } else {
+                    if (pid < 0) {
+                        perror("fork");
+                    }
+                    close(childfd);
+                }
             }
+        }
+    }
+}
+
+// Connection state of an event-loop worker, indexed by client id. Bytes are
+// sent from out; replies written meanwhile wait in replies and replace out
+// once it is sent, so a reply never splits or overtakes the notifications
+// already taken into out.
+typedef struct {
+    int fd;
+    int active;
+    unsigned gen;       // tags in-flight io_uring operations of this connection
+    int sending;        // io_uring send in flight
+    int closing;        // close once the in-flight send completes
+    int want_out;       // epoll: waiting for EPOLLOUT
+    int overflow;       // replies piled up past REPLY_BUF_MAX
+    int active_pos;
+    char in[1024];
+    size_t in_len;
+    batch_state batch;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    char *replies;
+    size_t replies_len;
+    size_t replies_cap;
+} io_conn;
+
+static io_conn *conns;
+static int active_ids[MAX_CLIENTS];
+static int active_count;
+// Connection whose input the calling thread is running, if any
+static __thread io_conn *reply_conn;
+
+// Grows a buffer to hold at least size bytes. Returns -1 when out of memory.
+static int reserve(char **buf, size_t *cap, size_t size) {
+    if (*cap >= size) return 0;
+    size_t n = *cap ? *cap : OUT_BUF_SIZE;
+    while (n < size) n *= 2;
+    char *p = realloc(*buf, n);
+    if (!p) return -1;
+    *buf = p;
+    *cap = n;
+    return 0;
+}
 
-            pid_t pid = fork();
-            if(pid == 0){
-                close(acceptfd);
-                client_agent(childfd);
-                close(childfd);
-                exit(EXIT_SUCCESS);
+// Writes a command reply. On an event-loop connection it is queued behind
+// the output already pending and sent by the loop; a client that lets more
+// than REPLY_BUF_MAX pile up unread is disconnected.
+void send_reply(int fd, const char *buf, size_t len) {
+    io_conn *c = reply_conn;
+    if (!c) {
+        write(fd, buf, len);
+        return;
+    }
+    if (c->overflow) return;
+    if (c->replies_len + len > REPLY_BUF_MAX ||
+        reserve(&c->replies, &c->replies_cap, c->replies_len + len) < 0) {
+        c->overflow = 1;
+        return;
+    }
+    memcpy(c->replies + c->replies_len, buf, len);
+    c->replies_len += len;
+}
 
-            } else {
-                close(childfd);
+// Registers an accepted socket; returns the client id or -1
+static int conn_open(int fd) {
+    int client_id;
+    register_client(&client_id, fd);
+    if (client_id == -1) {
+        write(fd, "Error: Server full\n", 19);
+        close(fd);
+        return -1;
+    }
+    io_conn *c = &conns[client_id];
+    unsigned gen = c->gen + 1;
+    free(c->batch.records);
+    free(c->out);
+    free(c->replies);
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->gen = gen;
+    c->active = 1;
+    c->batch.cmd = CMD_NONE;
+    c->active_pos = active_count;
+    active_ids[active_count++] = client_id;
+    return client_id;
+}
+
+static void conn_close(int client_id) {
+    io_conn *c = &conns[client_id];
+    if (!c->active) return;
+    c->active = 0;
+    active_ids[c->active_pos] = active_ids[--active_count];
+    conns[active_ids[c->active_pos]].active_pos = c->active_pos;
+    trace_attach(client_id);
+    remove_client_resources(client_id);
+    close(c->fd);
+}
+
+// Feeds received bytes to the command parser. Returns 1 when the
+// connection should be closed.
+static int conn_input(int client_id, const char *data, size_t len) {
+    io_conn *c = &conns[client_id];
+    int quit = 0;
+    trace_attach(client_id);
+    reply_conn = c;
+    while (len > 0 && !quit) {
+        size_t room = sizeof(c->in) - c->in_len - 1;
+        if (room == 0) {
+            quit = 1; // overlong line, as in the threaded reader
+            break;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(c->in + c->in_len, data, n);
+        c->in_len += n;
+        data += n;
+        len -= n;
+        quit = process_input(client_id, c->fd, c->in, &c->in_len, &c->batch);
+    }
+    reply_conn = NULL;
+    return quit || c->overflow;
+}
+
+// Moves as many whole queued notifications of client_id as fit into buf,
+// so they go out in a single send. Returns the number of bytes taken.
+size_t take_notifications(int client_id, char *buf, size_t size) {
+    client *cl = &shm->clients[client_id];
+    size_t len = 0;
+    lock_client(client_id);
+    while (cl->notif_tail != cl->notif_head) {
+        const notification *nt = &cl->notifications[cl->notif_tail];
+        notification_payload *p = nt->payload >= 0 ? &shm->payloads[nt->payload] : NULL;
+        const char *msg = p ? p->text : nt->message;
+        size_t n = p ? (size_t)p->len : strnlen(msg, 255);
+        if (len + n > size) break;
+        memcpy(buf + len, msg, n);
+        len += n;
+        if (p) __atomic_sub_fetch(&p->refs, 1, __ATOMIC_RELEASE);
+        cl->notif_tail = (cl->notif_tail + 1) % MAX_NOTIFICATIONS;
+        shm->stats[client_id].notif_sent++;
+    }
+    pthread_mutex_unlock(&cl->mutex);
+    return len;
+}
+
+// Once out is sent, refills it with the pending replies or else with
+// queued notifications. Not while an io_uring send reads out.
+static void conn_refill(int client_id) {
+    io_conn *c = &conns[client_id];
+    if (c->out_off < c->out_len) return;
+    c->out_off = c->out_len = 0;
+    if (c->replies_len > 0) {
+        char *buf = c->out;
+        size_t cap = c->out_cap;
+        c->out = c->replies;
+        c->out_cap = c->replies_cap;
+        c->out_len = c->replies_len;
+        c->replies = buf;
+        c->replies_cap = cap;
+        c->replies_len = 0;
+        return;
+    }
+    if (reserve(&c->out, &c->out_cap, OUT_BUF_SIZE) < 0) return;
+    c->out_len = take_notifications(client_id, c->out, OUT_BUF_SIZE);
+    if (c->out_len > 0) {
+        trace_attach(client_id);
+        trace_event(TRACE_SEND, CMD_NONE, c->out_len);
+    }
+}
+
+// Output of a peer that is gone
+static void conn_discard(io_conn *c) {
+    c->out_off = c->out_len = 0;
+    c->replies_len = 0;
+}
+
+static void epoll_flush(int epfd, int client_id) {
+    io_conn *c = &conns[client_id];
+    while (1) {
+        conn_refill(client_id);
+        if (c->out_len == 0) break;
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!c->want_out) {
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.u64 = 2UL << 32 | client_id };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->want_out = 1;
             }
+            return;
+        }
+        if (n < 0) {
+            // Peer is gone; the read side sees the close
+            conn_discard(c);
+            break;
         }
+        c->out_off += n;
+    }
+    if (c->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 2UL << 32 | client_id };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = 0;
     }
-    cleanup_shared_memory();
 }
 
-void remove_client_resources(int client_id) {
-    pthread_mutex_lock(&shm->mutex);
-    for (int i=0; i<MAX_SUPPLY; i++) {
-        if(shm->supplies[i].client_id == client_id) {
-            memset(&shm->supplies[i], 0, sizeof(supply));
-            shm->supplies[i].client_id = -1;
+// Event-loop worker on epoll. Listening sockets, client sockets and the
+// worker's doorbell eventfd share one epoll set; epoll data holds the kind
+// (0 listener, 1 doorbell, 2 client) in the high word.
+void epoll_worker_loop(int *listen_fds, int count) {
+    conns = calloc(MAX_CLIENTS, sizeof(io_conn));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!conns || epfd < 0) {
+        perror("epoll_worker_loop");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    for (int i = 0; i < count; i++) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fds[i], &ev);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = 1UL << 32;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, worker_efds[my_worker], &ev);
+
+    struct epoll_event events[64];
+    char buf[4096];
+    while (1) {
+        int n = epoll_wait(epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int e = 0; e < n; e++) {
+            int kind = events[e].data.u64 >> 32;
+            int id = events[e].data.u64 & 0xffffffff;
+
+            if (kind == 0) {
+                for (int k = 0; k < ACCEPT_BATCH; k++) {
+                    int fd = accept4(listen_fds[id], NULL, NULL, SOCK_CLOEXEC);
+                    if (fd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+                            perror("accept");
+                        }
+                        break;
+                    }
+                    int client_id = conn_open(fd);
+                    if (client_id == -1) continue;
+                    ev.events = EPOLLIN;
+                    ev.data.u64 = 2UL << 32 | client_id;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+            } else if (kind == 1) {
+                uint64_t v;
+                read(worker_efds[my_worker], &v, sizeof(v));
+                __atomic_store_n(&shm->doorbell_rung[my_worker], 0, __ATOMIC_RELEASE);
+                for (int k = 0; k < active_count; k++) {
+                    if (!conns[active_ids[k]].want_out) epoll_flush(epfd, active_ids[k]);
+                }
+            } else if (conns[id].active) {
+                if (events[e].events & EPOLLOUT) {
+                    epoll_flush(epfd, id);
+                }
+                if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    ssize_t len = read(conns[id].fd, buf, sizeof(buf));
+                    if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+                    int quit = len <= 0 || conn_input(id, buf, len);
+                    // Replies go out now, or on EPOLLOUT behind earlier output;
+                    // a client that quits gets what fits without blocking
+                    if (!conns[id].want_out) epoll_flush(epfd, id);
+                    if (quit) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, conns[id].fd, NULL);
+                        conn_close(id);
+                    }
+                }
+            }
         }
     }
-    for (int i=0; i<MAX_DEMAND; i++) {
-        if(shm->demands[i].client_id == client_id) {
-            memset(&shm->demands[i], 0, sizeof(demand));
-            shm->demands[i].client_id = -1;
+}
+
+// Minimal io_uring plumbing over the raw system calls
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // SQEs queued since the last io_uring_enter
+    struct io_uring_buf_ring *bufs;
+    char *buf_data;
+    char *rings;
+    size_t rings_size;
+    size_t sqes_size;
+} uring_state;
+
+// user_data of io_uring operations
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_DOORBELL, OP_PROBE };
+#define URING_DATA(op, gen, id) ((unsigned long)(op) << 56 | (unsigned long)((gen) & 0xffffff) << 32 | (unsigned)(id))
+
+// Releases the ring and its buffers, also those of a partly set up one
+static void uring_free(uring_state *u) {
+    if (u->fd >= 0) close(u->fd);
+    if (u->rings != MAP_FAILED) munmap(u->rings, u->rings_size);
+    if ((void *)u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if ((void *)u->bufs != MAP_FAILED) munmap(u->bufs, RECV_BUFS * sizeof(struct io_uring_buf));
+    free(u->buf_data);
+}
+
+static int uring_init(uring_state *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->rings = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->bufs = MAP_FAILED;
+    // Multishot operations post many completions per submission
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 8;
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        uring_free(u);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->rings == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+    char *rings = u->rings;
+    u->entries = p.sq_entries;
+    u->sq_head = (unsigned *)(rings + p.sq_off.head);
+    u->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(rings + p.sq_off.array);
+    u->cq_head = (unsigned *)(rings + p.cq_off.head);
+    u->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    u->pending = 0;
+
+    // Provided buffer ring for multishot receives
+    u->bufs = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buf_data = malloc(RECV_BUFS * RECV_BUF_SIZE);
+    if (u->bufs == MAP_FAILED || !u->buf_data) {
+        uring_free(u);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->bufs;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_free(u);
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_enter(uring_state *u, unsigned wait) {
+    int ret = syscall(__NR_io_uring_enter, u->fd, u->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) {
+        u->pending -= ret;
+    } else if (errno != EINTR) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_state *u) {
+    unsigned tail = *u->sq_tail;
+    // Submitting may be interrupted or take nothing; the slot must be free
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        uring_enter(u, 0);
+    }
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+    return sqe;
+}
+
+static void uring_provide(uring_state *u, int bid) {
+    unsigned short tail = u->bufs->tail;
+    struct io_uring_buf *b = &u->bufs->bufs[tail & (RECV_BUFS - 1)];
+    b->addr = (unsigned long)(u->buf_data + bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&u->bufs->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_accept(uring_state *u, int listener, int fd) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(OP_ACCEPT, 0, listener);
+}
+
+static void uring_recv(uring_state *u, int client_id) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conns[client_id].fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_DATA(OP_RECV, conns[client_id].gen, client_id);
+}
+
+// Whether the kernel takes multishot receives, which came after multishot
+// accept. A receive on a socket pair holding one byte and shut down after it
+// posts the byte, then ends on EOF, unless it fails at once with EINVAL.
+static int uring_probe_recv(uring_state *u) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return 0;
+    int supported = write(sv[1], "", 1) == 1 && shutdown(sv[1], SHUT_WR) == 0;
+    if (supported) {
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RECV_BGID;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = URING_DATA(OP_PROBE, 0, 0);
+        int done = 0;
+        while (!done) {
+            uring_enter(u, 1);
+            unsigned head = *u->cq_head;
+            while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+                head++;
+                __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+                if (cqe.flags & IORING_CQE_F_BUFFER) uring_provide(u, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res == -EINVAL) supported = 0;
+                if (!(cqe.flags & IORING_CQE_F_MORE)) done = 1;
+            }
         }
     }
-    for (int i=0; i<MAX_WATCH; i++) {
-        if(shm->watches[i].client_id == client_id) {
-            shm->watches[i].client_id = -1;
-            shm->watches[i].watch_id = 0;
+    close(sv[0]);
+    close(sv[1]);
+    return supported;
+}
+
+static void uring_doorbell(uring_state *u, uint64_t *value) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = worker_efds[my_worker];
+    sqe->addr = (unsigned long)value;
+    sqe->len = sizeof(*value);
+    sqe->off = -1;
+    sqe->user_data = URING_DATA(OP_DOORBELL, 0, 0);
+}
+
+// Queues a send of the connection's pending replies and notifications; all
+// sends queued in one loop iteration go to the kernel with a single
+// io_uring_enter.
+static void uring_flush(uring_state *u, int client_id) {
+    io_conn *c = &conns[client_id];
+    if (c->sending || !c->active) return;
+    conn_refill(client_id);
+    if (c->out_len == 0) return;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)(c->out + c->out_off);
+    sqe->len = c->out_len - c->out_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(OP_SEND, c->gen, client_id);
+    c->sending = 1;
+}
+
+static void uring_close(uring_state *u, int client_id) {
+    io_conn *c = &conns[client_id];
+    uring_flush(u, client_id);
+    if (c->sending) {
+        // The kernel still reads c->out; finish once the output is sent
+        c->closing = 1;
+        return;
+    }
+    conn_close(client_id);
+}
+
+// Event-loop worker on io_uring: multishot accept on every listener,
+// multishot receive into provided buffers on every client, and batched
+// sends of replies and notifications.
+// Falls back to epoll when io_uring or the needed features are missing.
+void uring_worker_loop(int *listen_fds, int count) {
+    uring_state u;
+    if (uring_init(&u) < 0) {
+        fprintf(stderr, "io_uring unavailable, using epoll\n");
+        return;
+    }
+    for (int i = 0; i < RECV_BUFS; i++) {
+        uring_provide(&u, i);
+    }
+    if (!uring_probe_recv(&u)) {
+        fprintf(stderr, "io_uring multishot receive unsupported, using epoll\n");
+        uring_free(&u);
+        return;
+    }
+    conns = calloc(MAX_CLIENTS, sizeof(io_conn));
+    if (!conns) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        uring_accept(&u, i, listen_fds[i]);
+    }
+    uint64_t doorbell_value;
+    uring_doorbell(&u, &doorbell_value);
+
+    while (1) {
+        uring_enter(&u, 1);
+
+        unsigned head = *u.cq_head;
+        while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = u.cqes[head & *u.cq_mask];
+            head++;
+            __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+            int op = cqe.user_data >> 56;
+            unsigned gen = (cqe.user_data >> 32) & 0xffffff;
+            int id = cqe.user_data & 0xffffffff;
+            int more = cqe.flags & IORING_CQE_F_MORE;
+
+            if (op == OP_ACCEPT) {
+                if (cqe.res == -EINVAL && !more) {
+                    fprintf(stderr, "io_uring multishot accept unsupported, using epoll\n");
+                    uring_free(&u);
+                    free(conns);
+                    conns = NULL;
+                    return;
+                }
+                if (cqe.res >= 0) {
+                    int client_id = conn_open(cqe.res);
+                    if (client_id != -1) uring_recv(&u, client_id);
+                }
+                if (!more) uring_accept(&u, id, listen_fds[id]);
+            } else if (op == OP_RECV) {
+                io_conn *c = &conns[id];
+                int quit = 0;
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (cqe.res > 0 && c->active && (c->gen & 0xffffff) == gen) {
+                        quit = conn_input(id, u.buf_data + bid * RECV_BUF_SIZE, cqe.res);
+                    }
+                    uring_provide(&u, bid);
+                }
+                if (!c->active || (c->gen & 0xffffff) != gen) continue;
+                if (quit) {
+                    // Ends the multishot receive with EOF, which closes below
+                    shutdown(c->fd, SHUT_RD);
+                } else if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS)) {
+                    uring_close(&u, id);
+                } else {
+                    uring_flush(&u, id);
+                    if (!more) uring_recv(&u, id);
+                }
+            } else if (op == OP_SEND) {
+                io_conn *c = &conns[id];
+                if (!c->active || (c->gen & 0xffffff) != gen) continue;
+                c->sending = 0;
+                if (cqe.res > 0) c->out_off += cqe.res;
+                else conn_discard(c); // peer gone; recv sees the close
+                uring_flush(&u, id);
+                if (c->closing && !c->sending) conn_close(id);
+            } else if (op == OP_DOORBELL) {
+                __atomic_store_n(&shm->doorbell_rung[my_worker], 0, __ATOMIC_RELEASE);
+                uring_doorbell(&u, &doorbell_value);
+                for (int k = 0; k < active_count; k++) {
+                    uring_flush(&u, active_ids[k]);
+                }
+            }
         }
     }
+}
+
+void remove_client_resources(int client_id) {
+    shm_lock(SITE_CLEANUP);
+    release_client(client_id);
+    shm_unlock(&shm->retired, CMD_NONE);
+}
+
+// Frees a client slot and everything the client owns; under shm->mutex
+void release_client(int client_id) {
+    supdem_engine_remove_client(engine, client_id);
+    dispatch_events();
+    unsubscribe_client(client_id);
+    drop_notifications(client_id);
     shm->clients[client_id].client_socket = -1;
     shm->clients[client_id].client_id = -1;
-    pthread_mutex_unlock(&shm->mutex);
+    shm->client_count--;
+
+    merge_stats(&shm->retired, &shm->stats[client_id]);
+    memset(&shm->stats[client_id], 0, sizeof(stats_slot));
 }
 
 void register_client(int *client_id, int client_socket){
-    pthread_mutex_lock(&shm->mutex);
+    shm_lock(SITE_REGISTER);
 
+    *client_id = -1;
     for(int i = 0; i < MAX_CLIENTS; i++){
         if(shm->clients[i].client_socket == -1){
             *client_id = i;
             shm->clients[i].client_socket = client_socket;
             shm->clients[i].client_id = *client_id;
-            shm->clients[i].x = 0;
-            shm->clients[i].y = 0;
             shm->clients[i].notif_head = 0;
             shm->clients[i].notif_tail = 0;
+            shm->clients[i].subscribed = 0;
+            memset(shm->clients[i].buckets, 0, sizeof(shm->clients[i].buckets));
+            shm->clients[i].worker = my_worker;
+            shm->clients[i].pid = getpid();
+            shm->client_count++;
             break;
         }
     }
-    pthread_mutex_unlock(&shm->mutex);
+    shm_unlock(*client_id != -1 ? &shm->stats[*client_id] : &shm->retired, CMD_NONE);
+}
+
+void *client_agent_thread(void *arg) {
+    client_agent((int)(long)arg);
+    return NULL;
 }
 
 void client_agent(int sockfd){
 
-    pthread_t command_thread, notification_thread;
+    pthread_t command_thread;
 
     int client_id;
     register_client(&client_id, sockfd);
+    if (client_id == -1) {
+        write(sockfd, "Error: Server full\n", 19);
+        close(sockfd);
+        return;
+    }
+    trace_attach(client_id);
 
     thread_arg *arg = (thread_arg *)malloc(sizeof(thread_arg));
     arg->sockfd = sockfd;
     arg->client_id = client_id;
 
+    // Errors only end this connection: in pre-fork mode the agent runs in a
+    // thread of a worker that serves other clients too.
     if(pthread_create(&command_thread, NULL, command_thread_func, arg) != 0){
         perror("pthread_create");
+        remove_client_resources(client_id);
         free(arg);
         close(sockfd);
-        exit(EXIT_FAILURE);
-    }
-
-    if(pthread_create(&notification_thread, NULL, notification_thread_func, arg) != 0){
-        perror("pthread_create");
-        pthread_cancel(command_thread);
-        pthread_join(command_thread, NULL);
-        free(arg);
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        return;
     }
+    notifier_attach(client_id, sockfd);
 
     pthread_join(command_thread, NULL);
-    pthread_cancel(notification_thread); 
-    pthread_join(notification_thread, NULL);
 
+    // Unblocks a notifier stuck sending to a peer that stopped reading
+    shutdown(sockfd, SHUT_RDWR);
+    notifier_detach(client_id);
     remove_client_resources(client_id);
 
     free(arg);
@@ -346,437 +1279,1939 @@ void client_agent(int sockfd){
 }
 
 void enqueue_notification(int client_id, const char *msg) {
-    pthread_mutex_lock(&shm->clients[client_id].mutex);
+    enqueue_payload(client_id, -1, msg);
+}
+
+// Queues payload for client_id by reference, or msg itself if payload is -1.
+// Entries without an owner notify nobody.
+void enqueue_payload(int client_id, int payload, const char *msg) {
+    if (client_id == SUPDEM_NO_OWNER) return;
+    lock_client(client_id);
     int next_head = (shm->clients[client_id].notif_head + 1) % MAX_NOTIFICATIONS;
     if (next_head == shm->clients[client_id].notif_tail) {
         // queue full, drop
+        shm->stats[client_id].notif_dropped++;
     } else {
-        strncpy(shm->clients[client_id].notifications[shm->clients[client_id].notif_head].message, msg, 255);
-        shm->clients[client_id].notifications[shm->clients[client_id].notif_head].message[255] = '\0';
+        shm->stats[client_id].notif_enqueued++;
+        trace_event(TRACE_ENQUEUE, CMD_NONE, client_id);
+        notification *nt = &shm->clients[client_id].notifications[shm->clients[client_id].notif_head];
+        nt->payload = payload;
+        if (payload >= 0) {
+            __atomic_add_fetch(&shm->payloads[payload].refs, 1, __ATOMIC_RELAXED);
+            shm->payload_refs++;
+        } else {
+            strncpy(nt->message, msg, 255);
+            nt->message[255] = '\0';
+        }
         shm->clients[client_id].notif_head = next_head;
         pthread_cond_signal(&shm->clients[client_id].condition);
+
+        int w = shm->clients[client_id].worker;
+        if (w >= 0 && !__atomic_exchange_n(&shm->doorbell_rung[w], 1, __ATOMIC_ACQ_REL)) {
+            uint64_t one = 1;
+            write(worker_efds[w], &one, sizeof(one));
+        }
     }
     pthread_mutex_unlock(&shm->clients[client_id].mutex);
 }
 
+// Renders msg into a free shared payload and returns it, or -1 if all are
+// referenced; then callers queue copies. Under shm->mutex, which makes this
+// the only writer of payloads with no references.
+int create_payload(const char *msg) {
+    for (int i = 0; i < MAX_PAYLOADS; i++) {
+        int id = (shm->payload_cursor + i) % MAX_PAYLOADS;
+        notification_payload *p = &shm->payloads[id];
+        if (__atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) != 0) continue;
+        shm->payload_cursor = (id + 1) % MAX_PAYLOADS;
+        strncpy(p->text, msg, 255);
+        p->text[255] = '\0';
+        p->len = strlen(p->text);
+        shm->payloads_created++;
+        return id;
+    }
+    shm->payloads_exhausted++;
+    return -1;
+}
+
+// Discards what is still queued for a departing client
+void drop_notifications(int client_id) {
+    client *cl = &shm->clients[client_id];
+    lock_client(client_id);
+    while (cl->notif_tail != cl->notif_head) {
+        int payload = cl->notifications[cl->notif_tail].payload;
+        if (payload >= 0) __atomic_sub_fetch(&shm->payloads[payload].refs, 1, __ATOMIC_RELEASE);
+        cl->notif_tail = (cl->notif_tail + 1) % MAX_NOTIFICATIONS;
+    }
+    pthread_mutex_unlock(&cl->mutex);
+}
+
 void *command_thread_func(void *arg){
     thread_arg *targ = (thread_arg *)arg;
     int client_socket = targ->sockfd;
     int client_id = targ->client_id;
+    trace_attach(client_id);
 
     char buffer[1024];
     size_t buffer_len = 0;
+    batch_state batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.cmd = CMD_NONE;
     while(1){
         ssize_t bytes_read = read(client_socket, buffer + buffer_len, sizeof(buffer) - buffer_len - 1);
         if(bytes_read <= 0){
     
             // Treat as quit
+            free(batch.records);
             return NULL;
         }
         buffer_len += bytes_read;
-        buffer[buffer_len] = '\0';
 
-        char *line_start = buffer;
-        char *newline_pos;
+        if (process_input(client_id, client_socket, buffer, &buffer_len, &batch)) {
+            free(batch.records);
+            return NULL;
+        }
+    }
+    return NULL;
+}
 
-        while ((newline_pos = strchr(line_start, '\n')) != NULL) {
-            *newline_pos = '\0';
-    
+// Runs every complete command line (and binary batch record) in buffer and
+// keeps the incomplete remainder at its start. Returns 1 when the client quit.
+int process_input(int client_id, int client_socket, char *buffer, size_t *buffer_len, batch_state *batch) {
+    size_t pos = 0;
+    int quit = 0;
+    while (pos < *buffer_len && !quit) {
+        if (batch->cmd != CMD_NONE && batch->binary) {
+            // Binary batch records follow their header line directly
+            size_t used = take_binary_records(batch, buffer + pos, *buffer_len - pos);
+            if (used == 0) break;
+            pos += used;
+            if (batch->received == batch->count) {
+                commit_batch(client_id, client_socket, batch);
+            }
+            continue;
+        }
 
-            char *command = line_start;
-            int x,y,a,b,c,distance,watch_id;
+        char *newline_pos = memchr(buffer + pos, '\n', *buffer_len - pos);
+        if (newline_pos == NULL) break;
+        *newline_pos = '\0';
 
-            pthread_mutex_lock(&shm->mutex);
-            if (sscanf(command, "move %d %d", &x, &y) == 2) {
-                move_client(client_id, x, y);
-                write(client_socket, "OK\n", 3);
-            }
-            else if (sscanf(command, "demand %d %d %d", &a, &b, &c) == 3) {
-                add_new_demand(client_id, a, b, c);
-                write(client_socket, "OK\n", 3);
-                check_for_match(client_id);
-            }
-            else if (sscanf(command, "supply %d %d %d %d", &distance, &a, &b, &c) == 4) {
-                int new_supply_index = -1;
-                new_supply_index = add_new_supply(client_id, distance, a, b, c);
-                write(client_socket, "OK\n", 3);
-                check_for_match(client_id);
-
-                if (new_supply_index != -1) {
-                    check_for_watch_events_on_new_supply(new_supply_index);
-                }
-            }
-            else if (sscanf(command, "watch %d", &watch_id) == 1) {
-                add_new_watch(client_id, watch_id);
-                write(client_socket, "OK\n", 3);
-            }
-            else if (strncmp(command, "unwatch", 7) == 0) {
-                remove_watch(client_id);
-                write(client_socket, "OK\n", 3);
-            }
-            else if (strncmp(command, "listsupplies", 12) == 0) {
-                list_supplies(client_id);
-            }
-            else if (strncmp(command, "listdemands", 11) == 0) {
-                list_demands(client_id);
-            }
-            else if (strncmp(command, "mysupplies", 10) == 0) {
-                my_supplies(client_id);
-            }
-            else if (strncmp(command, "mydemands", 9) == 0) {
-                my_demands(client_id);
-            }
-            else if (strncmp(command, "quit", 4) == 0) {
-                write(client_socket, "OK\n", 3);
-                pthread_mutex_unlock(&shm->mutex);
-                return NULL;
-            }
-            else {
-                write(client_socket, "Error: Invalid command\n", 24);
+        quit = handle_command(client_id, client_socket, buffer + pos, batch);
+        pos = newline_pos - buffer + 1;
+    }
+    *buffer_len -= pos;
+    memmove(buffer, buffer + pos, *buffer_len);
+    return quit;
+}
+
+// Runs one command line. Returns 1 when the client asked to quit.
+int handle_command(int client_id, int client_socket, char *command, batch_state *batch) {
+    int x,y,a,b,c,distance,watch_id,count;
+    int ttl = 0;
+    char mode[4];
+    list_query query;
+    int cmd = CMD_INVALID;
+    int quit = 0;
+
+    if (batch->cmd != CMD_NONE) {
+        add_batch_record(batch, command);
+        if (batch->received == batch->count) {
+            commit_batch(client_id, client_socket, batch);
+        }
+        return 0;
+    }
+
+    unsigned long start_ns = now_ns();
+    trace_event(TRACE_CMD_BEGIN, CMD_NONE, 0);
+
+    // Reports are served from the counters alone, without the global lock
+    if (strncmp(command, "stats", 5) == 0 || strncmp(command, "lockstats", 9) == 0) {
+        cmd = command[0] == 's' ? CMD_STATS : CMD_LOCKSTATS;
+        send_report(client_socket, cmd == CMD_STATS ? format_stats : format_lock_stats);
+        record_latency(&shm->stats[client_id].commands[cmd], now_ns() - start_ns);
+        trace_event(TRACE_CMD_END, cmd, 0);
+        return 0;
+    }
+    if (strncmp(command, "tracedump", 9) == 0) {
+        cmd = CMD_TRACEDUMP;
+        if (!traces) {
+            send_reply(client_socket, "Error: Tracing disabled\n", 24);
+        } else if (dump_traces(trace_path) < 0) {
+            send_reply(client_socket, "Error: Trace dump failed\n", 25);
+        } else {
+            send_reply(client_socket, "OK\n", 3);
+        }
+        record_latency(&shm->stats[client_id].commands[cmd], now_ns() - start_ns);
+        trace_event(TRACE_CMD_END, cmd, 0);
+        return 0;
+    }
+    // Everything below takes the global lock, so it is rate limited first
+    int klass = rate_class(command);
+    if (klass >= 0 && throttle(client_id, client_socket, klass, 1)) {
+        trace_event(TRACE_CMD_END, CMD_NONE, 0);
+        return 0;
+    }
+
+    // Takes the lock only to copy the tables; a child process writes the file
+    if (strncmp(command, "bgsave", 6) == 0) {
+        cmd = CMD_BGSAVE;
+        if (!snapshot_path) {
+            send_reply(client_socket, "Error: Snapshots disabled\n", 26);
+        } else {
+            int r = save_snapshot(client_id, snapshot_path);
+            if (r == 0) send_reply(client_socket, "OK\n", 3);
+            else if (r == -2) send_reply(client_socket, "Error: Snapshot in progress\n", 28);
+            else send_reply(client_socket, "Error: Snapshot failed\n", 23);
+        }
+        record_latency(&shm->stats[client_id].commands[cmd], now_ns() - start_ns);
+        trace_event(TRACE_CMD_END, cmd, 0);
+        return 0;
+    }
+
+    // Batch headers only start collecting records; the insert happens in commit_batch
+    int fields = sscanf(command, "supplybatch %d %3s", &count, mode);
+    cmd = CMD_SUPPLYBATCH;
+    if (fields < 1) {
+        fields = sscanf(command, "demandbatch %d %3s", &count, mode);
+        cmd = CMD_DEMANDBATCH;
+    }
+    if (fields >= 1) {
+        int binary = fields == 2 && strcmp(mode, "bin") == 0;
+        if (count < 0 || count > MAX_BATCH || (fields == 2 && !binary)) {
+            send_reply(client_socket, "Error: Invalid batch\n", 21);
+        } else {
+            start_batch(batch, cmd, count, binary);
+            if (count == 0) {
+                commit_batch(client_id, client_socket, batch);
             }
-            pthread_mutex_unlock(&shm->mutex);
+        }
+        trace_event(TRACE_CMD_END, CMD_NONE, 0);
+        return 0;
+    }
+    cmd = CMD_INVALID;
+
+    shm_lock(SITE_COMMAND);
+    if (sscanf(command, "move %d %d", &x, &y) == 2) {
+        cmd = CMD_MOVE;
+        if (supdem_engine_move(engine, client_id, x, y) < 0) {
+            send_reply(client_socket, "Error: Out of bounds\n", 21);
+        } else {
+            send_reply(client_socket, "OK\n", 3);
+        }
+    }
+    else if (sscanf(command, "demand %d %d %d %d", &a, &b, &c, &ttl) >= 3) {
+        cmd = CMD_DEMAND;
+        supdem_engine_insert_demand(engine, client_id, a, b, c, ttl_ticks(ttl));
+        dispatch_events();
+        send_reply(client_socket, "OK\n", 3);
+        supdem_engine_match(engine);
+        dispatch_events();
+    }
+    else if (sscanf(command, "supply %d %d %d %d %d", &distance, &a, &b, &c, &ttl) >= 4) {
+        cmd = CMD_SUPPLY;
+        int new_supply_index = supdem_engine_insert_supply(engine, client_id, distance, a, b, c, ttl_ticks(ttl));
+        dispatch_events();
+        send_reply(client_socket, "OK\n", 3);
+        supdem_engine_match(engine);
+
+        if (new_supply_index != -1) {
+            supdem_engine_announce(engine, new_supply_index);
+        }
+        dispatch_events();
+    }
+    else if (sscanf(command, "watch %d", &watch_id) == 1) {
+        cmd = CMD_WATCH;
+        supdem_engine_watch(engine, client_id, watch_id);
+        send_reply(client_socket, "OK\n", 3);
+    }
+    else if (strncmp(command, "unwatch", 7) == 0) {
+        cmd = CMD_UNWATCH;
+        supdem_engine_unwatch(engine, client_id);
+        send_reply(client_socket, "OK\n", 3);
+    }
+    else if (strncmp(command, "listsupplies", 12) == 0) {
+        cmd = CMD_LISTSUPPLIES;
+        supdem_engine_position(engine, client_id, &x, &y);
+        if (command[12 + strspn(command + 12, " ")] == '\0') {
+            list_supplies(client_id);
+        } else if (parse_list_query(x, y, command + 12, &query) == 0) {
+            list_query_entries(client_id, SUPDEM_SUPPLY, &query);
+        } else {
+            send_reply(client_socket, "Error: Invalid query\n", 21);
+        }
+    }
+    else if (strncmp(command, "listdemands", 11) == 0) {
+        cmd = CMD_LISTDEMANDS;
+        supdem_engine_position(engine, client_id, &x, &y);
+        if (command[11 + strspn(command + 11, " ")] == '\0') {
+            list_demands(client_id);
+        } else if (parse_list_query(x, y, command + 11, &query) == 0) {
+            list_query_entries(client_id, SUPDEM_DEMAND, &query);
+        } else {
+            send_reply(client_socket, "Error: Invalid query\n", 21);
+        }
+    }
+    else if (strncmp(command, "nearest", 7) == 0) {
+        cmd = CMD_NEAREST;
+        int k, fields = sscanf(command, "nearest %d %d %d %d", &k, &a, &b, &c);
+        if ((fields != 1 && fields != 4) || k <= 0 || k > MAX_NEAREST) {
+            send_reply(client_socket, "Error: Invalid query\n", 21);
+        } else {
+            if (fields == 1) a = b = c = 0;
+            list_nearest(client_id, k, a, b, c);
+        }
+    }
+    else if (strncmp(command, "mysupplies", 10) == 0) {
+        cmd = CMD_MYSUPPLIES;
+        my_supplies(client_id);
+    }
+    else if (strncmp(command, "mydemands", 9) == 0) {
+        cmd = CMD_MYDEMANDS;
+        my_demands(client_id);
+    }
+    else if (strncmp(command, "subscribe", 9) == 0) {
+        unsigned long version = 0;
+        int has_version = sscanf(command, "subscribe %lu", &version) == 1;
+        cmd = CMD_SUBSCRIBE;
+        subscribe_client(client_id, has_version, version);
+    }
+    else if (strncmp(command, "unsubscribe", 11) == 0) {
+        cmd = CMD_UNSUBSCRIBE;
+        unsubscribe_client(client_id);
+        send_reply(client_socket, "OK\n", 3);
+    }
+    else if (strncmp(command, "quit", 4) == 0) {
+        cmd = CMD_QUIT;
+        send_reply(client_socket, "OK\n", 3);
+        quit = 1;
+    }
+    else {
+        send_reply(client_socket, "Error: Invalid command\n", 24);
+    }
+    shm_unlock(&shm->stats[client_id], cmd);
+
+    record_latency(&shm->stats[client_id].commands[cmd], now_ns() - start_ns);
+    trace_event(TRACE_CMD_END, cmd, 0);
+    return quit;
+}
 
-            line_start = newline_pos + 1;
+// Bucket a command line draws on: updates for commands that change the
+// map, listings for the read-heavy ones, or -1 for none. Batch headers are
+// not updates themselves; their records are charged when the batch commits.
+int rate_class(const char *command) {
+    static const char *updates[] = { "move", "supply", "demand", "watch", "unwatch" };
+    static const char *listings[] = {
+        "listsupplies", "listdemands", "nearest", "mysupplies", "mydemands", "subscribe", "bgsave"
+    };
+    for (size_t i = 0; i < sizeof(updates) / sizeof(updates[0]); i++) {
+        size_t n = strlen(updates[i]);
+        if (strncmp(command, updates[i], n) == 0 && (command[n] == ' ' || command[n] == '\0')) {
+            return RATE_UPDATE;
         }
-        buffer_len = strlen(line_start);
-        memmove(buffer, line_start, buffer_len);
-        buffer[buffer_len] = '\0';
     }
-    return NULL;
+    for (size_t i = 0; i < sizeof(listings) / sizeof(listings[0]); i++) {
+        if (strncmp(command, listings[i], strlen(listings[i])) == 0) return RATE_LISTING;
+    }
+    return -1;
 }
 
-void *notification_thread_func(void *args){
-    thread_arg *targ = (thread_arg *) args;
-    int client_id = targ->client_id;
+// Draws cost tokens from the client's bucket of klass after refilling it for
+// the time since the last draw. A cost above the burst needs a full bucket.
+// Without enough tokens the client gets "Error: Throttled" and 1 is
+// returned; the command must then be dropped.
+int throttle(int client_id, int client_socket, int klass, double cost) {
+    const rate_limit *limit = &rate_limits[klass];
+    if (limit->rate <= 0) return 0;
+
+    token_bucket *b = &shm->clients[client_id].buckets[klass];
+    unsigned long now = now_ns();
+    if (b->stamp_ns == 0) {
+        b->tokens = limit->burst;
+    } else {
+        b->tokens += (now - b->stamp_ns) / 1e9 * limit->rate;
+        if (b->tokens > limit->burst) b->tokens = limit->burst;
+    }
+    b->stamp_ns = now;
 
-    while(1){
+    if (cost > limit->burst) cost = limit->burst;
+    if (b->tokens >= cost) {
+        b->tokens -= cost;
+        return 0;
+    }
+    shm->stats[client_id].throttled[klass]++;
+    send_reply(client_socket, "Error: Throttled\n", 17);
+    return 1;
+}
 
-        pthread_mutex_lock(&shm->clients[client_id].mutex);
-        while (shm->clients[client_id].notif_head == shm->clients[client_id].notif_tail) {
-            pthread_cond_wait(&shm->clients[client_id].condition, &shm->clients[client_id].mutex);
-        }
+// "rate[/burst]"; the burst defaults to one second worth of tokens
+void parse_rate(const char *arg, rate_limit *limit, const char *prog_name) {
+    int n = sscanf(arg, "%lf/%lf", &limit->rate, &limit->burst);
+    if (n == 1) limit->burst = limit->rate;
+    if (n < 1 || limit->rate <= 0 || limit->burst < 1) usage(prog_name);
+}
 
-        while (shm->clients[client_id].notif_tail != shm->clients[client_id].notif_head) {
-            char msg[256];
-            strncpy(msg, shm->clients[client_id].notifications[shm->clients[client_id].notif_tail].message, 255);
-            msg[255] = '\0';
-            shm->clients[client_id].notif_tail = (shm->clients[client_id].notif_tail + 1) % MAX_NOTIFICATIONS;
+void start_batch(batch_state *batch, int cmd, int count, int binary) {
+    int (*records)[4] = realloc(batch->records, (count ? count : 1) * sizeof(*records));
+    if (!records) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    batch->records = records;
+    batch->cmd = cmd;
+    batch->binary = binary;
+    batch->count = count;
+    batch->received = 0;
+    batch->failed = 0;
+}
 
-            pthread_mutex_unlock(&shm->clients[client_id].mutex);
-            notify_client(shm->clients[client_id].client_socket, msg);
-            pthread_mutex_lock(&shm->clients[client_id].mutex);
+// Text record: "<distance> <a> <b> <c>" for supplies, "<a> <b> <c>" for demands
+void add_batch_record(batch_state *batch, const char *line) {
+    int *r = batch->records[batch->received++];
+    if (batch->cmd == CMD_SUPPLYBATCH) {
+        if (sscanf(line, "%d %d %d %d", &r[0], &r[1], &r[2], &r[3]) != 4) batch->failed = 1;
+    } else {
+        r[0] = 0;
+        if (sscanf(line, "%d %d %d", &r[1], &r[2], &r[3]) != 3) batch->failed = 1;
+    }
+}
+
+// Binary records are 32-bit big-endian integers in the same order as the text
+// form. Consumes only whole records and returns the number of bytes used.
+size_t take_binary_records(batch_state *batch, const char *data, size_t len) {
+    int fields = batch->cmd == CMD_SUPPLYBATCH ? 4 : 3;
+    size_t record_size = fields * sizeof(uint32_t);
+    size_t used = 0;
+    while (batch->received < batch->count && len - used >= record_size) {
+        int *r = batch->records[batch->received++];
+        uint32_t v[4] = {0};
+        memcpy(&v[4 - fields], data + used, record_size);
+        for (int i = 0; i < 4; i++) {
+            r[i] = (int)ntohl(v[i]);
         }
+        used += record_size;
+    }
+    return used;
+}
 
-        pthread_mutex_unlock(&shm->clients[client_id].mutex);
+// Inserts all records of a completed batch under one lock acquisition, or
+// none of them if the batch is malformed or does not fit. Matching runs once
+// for the whole batch.
+void commit_batch(int client_id, int client_socket, batch_state *batch) {
+    int cmd = batch->cmd;
+    unsigned long start_ns = now_ns();
+    trace_event(TRACE_CMD_BEGIN, CMD_NONE, 0);
+
+    double cost = batch->count > RATE_BATCH_RECORDS ? (double)batch->count / RATE_BATCH_RECORDS : 1;
+    if (throttle(client_id, client_socket, RATE_UPDATE, cost)) {
+        trace_event(TRACE_CMD_END, CMD_NONE, 0);
+        batch->cmd = CMD_NONE;
+        return;
     }
-    return NULL;
+
+    shm_lock(SITE_COMMAND);
+    supdem_counts counts;
+    supdem_engine_counts(engine, &counts);
+    int free_slots = cmd == CMD_SUPPLYBATCH ? MAX_SUPPLY - counts.supplies : MAX_DEMAND - counts.demands;
+    if (batch->failed) {
+        send_reply(client_socket, "Error: Invalid batch record\n", 28);
+    } else if (batch->count > free_slots) {
+        send_reply(client_socket, "Error: Not enough space\n", 24);
+    } else {
+        int *inserted = malloc((batch->count ? batch->count : 1) * sizeof(int));
+        if (!inserted) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < batch->count; i++) {
+            int *r = batch->records[i];
+            if (cmd == CMD_SUPPLYBATCH) {
+                inserted[i] = supdem_engine_insert_supply(engine, client_id, r[0], r[1], r[2], r[3], 0);
+            } else {
+                supdem_engine_insert_demand(engine, client_id, r[1], r[2], r[3], 0);
+            }
+        }
+        dispatch_events();
+
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "OK %d\n", batch->count);
+        send_reply(client_socket, ack, len);
+        supdem_engine_match(engine);
+        dispatch_events();
+
+        if (cmd == CMD_SUPPLYBATCH) {
+            for (int i = 0; i < batch->count; i++) {
+                if (inserted[i] != -1) {
+                    supdem_engine_announce(engine, inserted[i]);
+                    dispatch_events();
+                }
+            }
+        }
+        free(inserted);
+    }
+    shm_unlock(&shm->stats[client_id], cmd);
+
+    record_latency(&shm->stats[client_id].commands[cmd], now_ns() - start_ns);
+    trace_event(TRACE_CMD_END, cmd, 0);
+    batch->cmd = CMD_NONE;
 }
 
-void add_new_demand(int client_id, int a, int b, int c){
-    for(int i = 0; i < MAX_DEMAND; i++){
-        if(shm->demands[i].client_id == -1){
-            shm->demands[i].x = shm->clients[client_id].x;
-            shm->demands[i].y = shm->clients[client_id].y;
-            shm->demands[i].client_id = client_id;
-            shm->demands[i].a_amount = a;
-            shm->demands[i].b_amount = b;
-            shm->demands[i].c_amount = c;
+// Notifier pool of this process: its threads deliver the notification
+// queues of every client the process serves, so the thread count does not
+// grow with the clients. In a pre-fork worker NOTIFIER_THREADS notifiers
+// sleep on the worker's doorbell eventfd. An agent forked per connection
+// serves one client and has no doorbell that other processes could ring,
+// so its single notifier waits on the client's condition instead.
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;              // a client stopped being busy
+    pthread_t threads[NOTIFIER_THREADS];
+    int thread_count;
+    int efd;                          // doorbell, -1 in a per-connection agent
+    int fds[MAX_CLIENTS];             // socket of an attached client, -1 once detached
+    int busy[MAX_CLIENTS];            // a notifier is sending to the client
+    int pos[MAX_CLIENTS];
+    int ids[MAX_CLIENTS];             // attached clients
+    int count;
+    int next;                         // where the next scan starts
+} notifier = { .mutex = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+static pthread_once_t notifier_once = PTHREAD_ONCE_INIT;
+
+static void notifier_start() {
+    notifier.efd = my_worker >= 0 ? worker_efds[my_worker] : -1;
+    int threads = my_worker >= 0 ? NOTIFIER_THREADS : 1;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&notifier.threads[i], NULL, notifier_thread_func, NULL) != 0) {
+            perror("pthread_create");
             break;
         }
+        notifier.thread_count++;
     }
 }
 
-int add_new_supply(int client_id, int distance, int a, int b, int c){
-    for(int i = 0; i < MAX_SUPPLY; i++){
-        if(shm->supplies[i].client_id == -1){
-            shm->supplies[i].client_id = client_id;
-            shm->supplies[i].x = shm->clients[client_id].x;
-            shm->supplies[i].y = shm->clients[client_id].y;
-            shm->supplies[i].a_amount = a;
-            shm->supplies[i].b_amount = b;
-            shm->supplies[i].c_amount = c;
-            shm->supplies[i].distance = distance;
-            return i;
+void notifier_attach(int client_id, int sockfd) {
+    pthread_mutex_lock(&notifier.mutex);
+    notifier.fds[client_id] = sockfd;
+    notifier.busy[client_id] = 0;
+    notifier.pos[client_id] = notifier.count;
+    notifier.ids[notifier.count++] = client_id;
+    pthread_mutex_unlock(&notifier.mutex);
+    pthread_once(&notifier_once, notifier_start);
+}
+
+// Returns once no notifier uses the client's socket any more. A
+// per-connection agent also stops its notifier, which only served it.
+void notifier_detach(int client_id) {
+    if (notifier.efd < 0) {
+        client *cl = &shm->clients[client_id];
+        lock_client(client_id);
+        notifier.fds[client_id] = -1;
+        pthread_cond_broadcast(&cl->condition);
+        pthread_mutex_unlock(&cl->mutex);
+        for (int i = 0; i < notifier.thread_count; i++) {
+            pthread_join(notifier.threads[i], NULL);
         }
     }
-    return -1;
+
+    pthread_mutex_lock(&notifier.mutex);
+    while (notifier.busy[client_id]) {
+        pthread_cond_wait(&notifier.idle, &notifier.mutex);
+    }
+    int last = notifier.ids[--notifier.count];
+    notifier.ids[notifier.pos[client_id]] = last;
+    notifier.pos[last] = notifier.pos[client_id];
+    notifier.fds[client_id] = -1;
+    pthread_mutex_unlock(&notifier.mutex);
 }
 
-void add_new_watch(int client_id, int new_watch_id){
-    for(int i = 0; i < MAX_WATCH; i++){
-        if(shm->watches[i].client_id == client_id){
-            shm->watches[i].client_id = -1;
-            shm->watches[i].watch_id = 0;
+// Sleeps until some notification may be queued; returns 0 when the
+// notifier should exit
+static int notifier_wait() {
+    if (notifier.efd >= 0) {
+        uint64_t v;
+        while (read(notifier.efd, &v, sizeof(v)) < 0 && errno == EINTR);
+        __atomic_store_n(&shm->doorbell_rung[my_worker], 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    int client_id = notifier.ids[0];
+    client *cl = &shm->clients[client_id];
+    lock_client(client_id);
+    while (cl->notif_head == cl->notif_tail && notifier.fds[client_id] != -1) {
+        if (pthread_cond_wait(&cl->condition, &cl->mutex) == EOWNERDEAD) {
+            pthread_mutex_consistent(&cl->mutex);
         }
     }
-    // Add new watch
-    for(int i = 0; i < MAX_WATCH; i++){
-        if(shm->watches[i].client_id == -1){
-            shm->watches[i].client_id = client_id;
-            shm->watches[i].x = shm->clients[client_id].x;
-            shm->watches[i].y = shm->clients[client_id].y;
-            shm->watches[i].watch_id = new_watch_id;
-            break;
+    int attached = notifier.fds[client_id] != -1;
+    pthread_mutex_unlock(&cl->mutex);
+    return attached;
+}
+
+// Marks an attached client with queued notifications busy and returns it,
+// or -1 when there is none. If more are waiting, the doorbell is rung again
+// so that another notifier serves them in parallel.
+static int notifier_claim() {
+    int found = -1, more = 0;
+    pthread_mutex_lock(&notifier.mutex);
+    for (int k = 0; k < notifier.count && !more; k++) {
+        int client_id = notifier.ids[(notifier.next + k) % notifier.count];
+        client *cl = &shm->clients[client_id];
+        if (notifier.busy[client_id] || cl->notif_head == cl->notif_tail) continue;
+        if (found == -1) {
+            found = client_id;
+            notifier.next = (notifier.next + k + 1) % notifier.count;
+        } else {
+            more = 1;
         }
     }
+    if (found != -1) notifier.busy[found] = 1;
+    pthread_mutex_unlock(&notifier.mutex);
+
+    if (more && notifier.efd >= 0) {
+        uint64_t one = 1;
+        write(notifier.efd, &one, sizeof(one));
+    }
+    return found;
 }
 
-void remove_watch(int client_id){
-    for(int i = 0; i < MAX_WATCH; i++){
-        if(shm->watches[i].client_id == client_id){
-            shm->watches[i].client_id = -1;
-            shm->watches[i].watch_id = 0;
+// Sends everything queued for a busy client, several notifications per
+// send. Once the peer is gone the queue is only emptied.
+static void notifier_deliver(int client_id, char *buf) {
+    int fd = notifier.fds[client_id];
+    int dead = 0;
+    size_t len;
+    trace_attach(client_id);
+    while ((len = take_notifications(client_id, buf, OUT_BUF_SIZE)) > 0) {
+        if (dead) continue;
+        trace_event(TRACE_SEND, CMD_NONE, len);
+        for (size_t off = 0; off < len && !dead; ) {
+            ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) dead = 1;
+            else off += n;
         }
     }
 }
 
-int check_for_match(int client_id){
-    for (int j=0; j<MAX_DEMAND; j++){
-        if(shm->demands[j].client_id != -1) {
-            for (int i=0; i<MAX_SUPPLY; i++){
-                if (shm->supplies[i].client_id != -1 && check_case_match(j, i)) {
-                    match_demand_and_supply(j, i);
-                }
-            }
+void *notifier_thread_func(void *arg) {
+    (void)arg;
+    char buf[OUT_BUF_SIZE];
+    while (notifier_wait()) {
+        int client_id;
+        while ((client_id = notifier_claim()) != -1) {
+            notifier_deliver(client_id, buf);
+            pthread_mutex_lock(&notifier.mutex);
+            notifier.busy[client_id] = 0;
+            pthread_cond_broadcast(&notifier.idle);
+            pthread_mutex_unlock(&notifier.mutex);
         }
     }
-    return 0;
+    return NULL;
 }
 
-void check_for_watch_events_on_new_supply(int supply_index) {
-    // Only check watchers for this newly inserted supply
-    if(shm->supplies[supply_index].client_id == -1) return; // invalid supply
-    supply *s = &shm->supplies[supply_index];
-    for (int i=0; i<MAX_WATCH; i++){
-        if (shm->watches[i].client_id != -1 && shm->watches[i].watch_id > 0) {
-            int distance = manhattan_distance(shm->watches[i].x, shm->watches[i].y, s->x, s->y);
-            if (distance <= shm->watches[i].watch_id) {
-                int watch_client = shm->watches[i].client_id;
-                char msg[256];
-                snprintf(msg, sizeof(msg), "A supply [%d,%d,%d] is inserted at (%d,%d).\n",
-                         s->a_amount, s->b_amount, s->c_amount, s->x, s->y);
-                enqueue_notification(watch_client, msg);
-            }
+// The watch hits of an announced supply come back to back; they all queue
+// the payload rendered for the first one
+typedef struct {
+    int index; // supply announced, -1 for none yet
+    supdem_supply supply;
+    int payload;
+    char text[256];
+} watch_fanout;
+
+// Turns one engine event into client notifications or a change feed entry
+static void handle_event(const supdem_event *ev, watch_fanout *w) {
+    const supdem_supply *s = &ev->supply;
+    const supdem_demand *d = &ev->demand;
+    char msg[256];
+
+    switch (ev->type) {
+    case SUPDEM_EV_MATCH:
+        trace_event(TRACE_MATCH, CMD_NONE, (d->client_id & 0xffff) << 16 | (s->client_id & 0xffff));
+        snprintf(msg, sizeof(msg),
+                 "Your demand at (%d,%d), [%d,%d,%d] is fulfilled by a supply at (%d,%d).\n",
+                 d->x, d->y, d->a_amount, d->b_amount, d->c_amount, s->x, s->y);
+        enqueue_notification(d->client_id, msg);
+        snprintf(msg, sizeof(msg),
+                 "Your supply at (%d,%d), [%d,%d,%d] with distance %d is delivered to a demand at (%d,%d) [%d,%d,%d].\n",
+                 s->x, s->y, s->a_amount, s->b_amount, s->c_amount, s->distance,
+                 d->x, d->y, d->a_amount, d->b_amount, d->c_amount);
+        enqueue_notification(s->client_id, msg);
+        break;
+    case SUPDEM_EV_EXHAUSTED:
+        enqueue_notification(ev->client_id, "Your supply is removed from map.\n");
+        break;
+    case SUPDEM_EV_WATCH:
+        if (w->index != ev->index || memcmp(&w->supply, s, sizeof(*s)) != 0) {
+            snprintf(w->text, sizeof(w->text), "A supply [%d,%d,%d] is inserted at (%d,%d).\n",
+                     s->a_amount, s->b_amount, s->c_amount, s->x, s->y);
+            w->index = ev->index;
+            w->supply = *s;
+            w->payload = create_payload(w->text);
+        }
+        enqueue_payload(ev->client_id, w->payload, w->text);
+        break;
+    case SUPDEM_EV_EXPIRED:
+        if (ev->kind == 'S') {
+            snprintf(msg, sizeof(msg), "Your supply at (%d,%d), [%d,%d,%d] has expired.\n",
+                     s->x, s->y, s->a_amount, s->b_amount, s->c_amount);
+        } else {
+            snprintf(msg, sizeof(msg), "Your demand at (%d,%d), [%d,%d,%d] has expired.\n",
+                     d->x, d->y, d->a_amount, d->b_amount, d->c_amount);
+        }
+        enqueue_notification(ev->client_id, msg);
+        break;
+    case SUPDEM_EV_CHANGE:
+        record_change(ev);
+        break;
+    }
+}
+
+// Delivers everything the engine queued during the last operation, in order
+void dispatch_events() {
+    supdem_event events[64];
+    watch_fanout w;
+    int n;
+    w.index = -1;
+    while ((n = supdem_engine_drain(engine, events, 64)) > 0) {
+        for (int i = 0; i < n; i++) {
+            handle_event(&events[i], &w);
         }
     }
+
+    supdem_oracle_status st;
+    if (supdem_engine_oracle(engine, &st) == 0 && st.divergences > shm->oracle_reported) {
+        fprintf(stderr, "Engine diverged from reference (%lu of %lu checks): %s\n",
+                st.divergences, st.checks, st.last);
+        shm->oracle_reported = st.divergences;
+    }
 }
 
-int check_case_match(int demand_id, int supply_id){
-    supply *s = &shm->supplies[supply_id];
-    demand *d = &shm->demands[demand_id];
+// TTL in seconds to engine ticks, 0 for none
+static unsigned long ttl_ticks(int ttl) {
+    if (ttl <= 0) return 0;
+    unsigned long ticks = (unsigned long)ttl * 1000 / TIMER_TICK_MS;
+    return ticks ? ticks : 1;
+}
 
-    if (d->client_id == -1 || s->client_id == -1) return 0;
+// Timer process: catches the engine clock up with real time every tick
+void timer_loop() {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+        unsigned long target = (now_ns() - shm->start_ns) / (TIMER_TICK_MS * 1000000UL);
+        shm_lock(SITE_EXPIRE);
+        supdem_engine_advance(engine, target);
+        dispatch_events();
+        shm_unlock(&shm->retired, CMD_NONE);
+    }
+}
 
-    int distance = manhattan_distance(d->x, d->y, s->x, s->y);
+void list_supplies(int client_id) {
+    list_cached(client_id, SUPDEM_SUPPLY);
+}
 
-    if(distance < s->distance && s->a_amount >= d->a_amount && s->b_amount >= d->b_amount && s->c_amount >= d->c_amount){
-        return 1;
+void list_demands(int client_id) {
+    list_cached(client_id, SUPDEM_DEMAND);
+}
+
+// Sends the unfiltered listing of kind from the cache, rendering it first
+// if the tables changed since it was
+void list_cached(int client_id, int kind) {
+    listing_cache *c = &shm->listings[kind];
+    int client_socket = shm->clients[client_id].client_socket;
+
+    if (c->len > 0 && c->version == shm->version) {
+        shm->listing_hits++;
+        send_reply(client_socket, c->text, c->len);
+        return;
+    }
+
+    list_query q;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    parse_list_query(0, 0, NULL, &q);
+    format_listing(out, engine, kind, &q);
+    fclose(out);
+    shm->listing_renders++;
+
+    if (len <= sizeof(c->text)) {
+        memcpy(c->text, text, len);
+        c->len = len;
+        c->version = shm->version;
+    } else {
+        c->len = 0;
+    }
+    send_reply(client_socket, text, len);
+    free(text);
+}
+
+// Parses "[near <r>] [box <x1> <y1> <x2> <y2>] [min <a> <b> <c>] [limit <n>]
+// [after <cursor>]". Returns -1 on malformed input; NULL args give the
+// query matching everything.
+int parse_list_query(int x, int y, char *args, list_query *q) {
+    supdem_query *f = &q->filter;
+    f->x1 = f->y1 = -2000000000;
+    f->x2 = f->y2 = 2000000000;
+    f->near = 0;
+    f->min_a = f->min_b = f->min_c = 0;
+    f->owner = -1;
+    f->after = -1;
+    q->limit = 0;
+
+    char *save;
+    char *tok = args ? strtok_r(args, " ", &save) : NULL;
+    while (tok) {
+        int v[4];
+        int want = 0;
+        if (strcmp(tok, "near") == 0) want = 1;
+        else if (strcmp(tok, "box") == 0) want = 4;
+        else if (strcmp(tok, "min") == 0) want = 3;
+        else if (strcmp(tok, "limit") == 0) want = 1;
+        else if (strcmp(tok, "after") == 0) want = 1;
+        else return -1;
+
+        for (int i = 0; i < want; i++) {
+            char *num = strtok_r(NULL, " ", &save);
+            char *end;
+            if (!num) return -1;
+            errno = 0;
+            long n = strtol(num, &end, 10);
+            if (*end != '\0' || errno == ERANGE || n < INT_MIN || n > INT_MAX) return -1;
+            v[i] = n;
+        }
+
+        if (strcmp(tok, "near") == 0) {
+            if (v[0] < 0) return -1;
+            f->near = 1;
+            f->x = x;
+            f->y = y;
+            f->radius = v[0];
+            // Narrow the box to the diamond's bounding box, in long so a
+            // huge radius cannot overflow
+            if ((long)f->x - v[0] > f->x1) f->x1 = f->x - v[0];
+            if ((long)f->y - v[0] > f->y1) f->y1 = f->y - v[0];
+            if ((long)f->x + v[0] < f->x2) f->x2 = f->x + v[0];
+            if ((long)f->y + v[0] < f->y2) f->y2 = f->y + v[0];
+        } else if (strcmp(tok, "box") == 0) {
+            if (v[0] > v[2] || v[1] > v[3]) return -1;
+            if (v[0] > f->x1) f->x1 = v[0];
+            if (v[1] > f->y1) f->y1 = v[1];
+            if (v[2] < f->x2) f->x2 = v[2];
+            if (v[3] < f->y2) f->y2 = v[3];
+        } else if (strcmp(tok, "min") == 0) {
+            f->min_a = v[0];
+            f->min_b = v[1];
+            f->min_c = v[2];
+        } else if (strcmp(tok, "limit") == 0) {
+            if (v[0] <= 0) return -1;
+            q->limit = v[0];
+        } else {
+            f->after = v[0];
+        }
+        tok = strtok_r(NULL, " ", &save);
     }
     return 0;
 }
 
-void match_demand_and_supply(int demand_id, int supply_id) {
-    supply *s = &shm->supplies[supply_id];
-    demand *d = &shm->demands[demand_id];
+// Lists the supplies (or demands) that satisfy q in index order, in the same
+// table format as the unfiltered listing. The count in the header is the
+// number of rows sent; when a limit cuts the result short, a trailing
+// "Next: after <cursor>" line gives the cursor for the following page.
+void list_query_entries(int client_id, int kind, const list_query *q) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    format_listing(out, engine, kind, q);
+    fclose(out);
+    send_reply(shm->clients[client_id].client_socket, text, len);
+    free(text);
+}
 
-    // Demand notification
-    if (d->client_id != -1) {
-        char demand_message[256];
-        snprintf(demand_message, sizeof(demand_message),
-                 "Your demand at (%d,%d), [%d,%d,%d] is fulfilled by a supply at (%d,%d).\n",
-                 d->x, d->y, d->a_amount, d->b_amount, d->c_amount, s->x, s->y);
-        enqueue_notification(d->client_id, demand_message);
+// The k supplies nearest the client holding at least a, b and c, nearest
+// first, with their distance from the client in the last column
+void list_nearest(int client_id, int k, int a, int b, int c) {
+    int found[MAX_NEAREST];
+    int x, y;
+    supdem_engine_position(engine, client_id, &x, &y);
+    int n = supdem_engine_nearest(engine, x, y, k, a, b, c, found);
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
     }
+    fprintf(out, "There are %d nearest supplies.\n"
+                 "X | Y | A | B | C | D | M |\n"
+                 "-------+-------+-----+-----+-----+-------+-------+\n", n);
+    for (int i = 0; i < n; i++) {
+        const supdem_supply *s = supdem_engine_supply(engine, found[i]);
+        fprintf(out, "%7d|%7d|%5d|%5d|%5d|%7d|%7d|\n", s->x, s->y, s->a_amount, s->b_amount, s->c_amount,
+                s->distance, abs(s->x - x) + abs(s->y - y));
+    }
+    fclose(out);
+    send_reply(shm->clients[client_id].client_socket, text, len);
+    free(text);
+}
 
-    // Supply notification
-    if (s->client_id != -1) {
-        char supply_message[256];
-        snprintf(supply_message, sizeof(supply_message),
-                 "Your supply at (%d,%d), [%d,%d,%d] with distance %d is delivered to a demand at (%d,%d) [%d,%d,%d].\n",
-                 s->x, s->y, s->a_amount, s->b_amount, s->c_amount, s->distance,
-                 d->x, d->y, d->a_amount, d->b_amount, d->c_amount);
-        enqueue_notification(s->client_id, supply_message);
+// Renders the entries of kind in e that satisfy q, as listsupplies and
+// listdemands print them
+void format_listing(FILE *out, const supdem_engine *e, int kind, const list_query *q) {
+    int *found = malloc(MAX_ENTRIES * sizeof(int));
+    if (!found) {
+        perror("malloc");
+        return;
     }
+    int n = supdem_engine_query(e, kind, &q->filter, found);
 
-    // Deduct from supply
-    s->a_amount -= d->a_amount;
-    s->b_amount -= d->b_amount;
-    s->c_amount -= d->c_amount;
+    int more = q->limit > 0 && n > q->limit;
+    if (more) n = q->limit;
 
-    // Remove demand
-    remove_demand(demand_id);
+    if (kind == SUPDEM_SUPPLY) {
+        fprintf(out, "There are %d supplies in total.\n"
+                     "X | Y | A | B | C | D |\n"
+                     "-------+-------+-----+-----+-----+-------+\n", n);
+    } else {
+        fprintf(out, "There are %d demands in total.\n"
+                     "X | Y | A | B | C |\n"
+                     "-------+-------+-----+-----+-----+\n", n);
+    }
 
-    // If supply exhausted
-    if (s->a_amount == 0 && s->b_amount == 0 && s->c_amount == 0) {
-        if (s->client_id != -1) {
-            char msg[256];
-            snprintf(msg, sizeof(msg), "Your supply is removed from map.\n");
-            enqueue_notification(s->client_id, msg);
+    for (int k = 0; k < n; k++) {
+        if (kind == SUPDEM_SUPPLY) {
+            const supdem_supply *s = supdem_engine_supply(e, found[k]);
+            fprintf(out, "%7d|%7d|%5d|%5d|%5d|%7d|\n",
+                    s->x, s->y, s->a_amount, s->b_amount, s->c_amount, s->distance);
+        } else {
+            const supdem_demand *d = supdem_engine_demand(e, found[k]);
+            fprintf(out, "%7d|%7d|%5d|%5d|%5d|\n",
+                    d->x, d->y, d->a_amount, d->b_amount, d->c_amount);
         }
-        remove_supply(supply_id);
     }
+    if (more) {
+        fprintf(out, "Next: after %d\n", found[n - 1]);
+    }
+    free(found);
 }
 
-void notify_client(int client_socket, const char *message) {
-    if (client_socket == -1) {
+// The entry is written before the version that covers it is published,
+// so the replica can read the log without the lock
+void record_change(const supdem_event *ev) {
+    unsigned long version = shm->version + 1;
+    change_event *e = &shm->change_log[version % CHANGE_LOG_SIZE];
+    memset(e, 0, sizeof(*e));
+    e->version = version;
+    e->op = ev->op;
+    e->kind = ev->kind;
+    e->index = ev->index;
+    if (ev->op != '-') {
+        if (ev->kind == 'S') {
+            const supdem_supply *s = &ev->supply;
+            e->x = s->x; e->y = s->y; e->distance = s->distance; e->client_id = s->client_id;
+            e->a_amount = s->a_amount; e->b_amount = s->b_amount; e->c_amount = s->c_amount;
+        } else {
+            const supdem_demand *d = &ev->demand;
+            e->x = d->x; e->y = d->y; e->client_id = d->client_id;
+            e->a_amount = d->a_amount; e->b_amount = d->b_amount; e->c_amount = d->c_amount;
+        }
+    }
+    __atomic_store_n(&shm->version, version, __ATOMIC_RELEASE);
 
+    if (shm->subscriber_count == 0) return;
+    char msg[256];
+    format_change(e, msg, sizeof(msg));
+    int payload = create_payload(msg);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (shm->clients[i].client_id != -1 && shm->clients[i].subscribed) {
+            enqueue_payload(i, payload, msg);
+        }
+    }
+}
+
+// "Change <version> <op><kind> <index> [<x> <y> <a> <b> <c> [<distance>]]"
+int format_change(const change_event *e, char *buf, size_t size) {
+    if (e->op == '-') {
+        return snprintf(buf, size, "Change %lu %c%c %d\n", e->version, e->op, e->kind, e->index);
+    }
+    if (e->kind == 'D') {
+        return snprintf(buf, size, "Change %lu %c%c %d %d %d %d %d %d\n", e->version, e->op, e->kind,
+                        e->index, e->x, e->y, e->a_amount, e->b_amount, e->c_amount);
+    }
+    return snprintf(buf, size, "Change %lu %c%c %d %d %d %d %d %d %d\n", e->version, e->op, e->kind,
+                    e->index, e->x, e->y, e->a_amount, e->b_amount, e->c_amount, e->distance);
+}
+
+// Starts the change feed for a client. Resuming from a version still covered
+// by the log replays the missed events; otherwise the client gets a snapshot
+// of every live entry as "+" events at the current version. Either way the
+// feed continues through the notification queue with contiguous versions,
+// so a subscriber that sees a jump (e.g. after queue drops) resubscribes.
+void subscribe_client(int client_id, int has_version, unsigned long version) {
+    int fd = shm->clients[client_id].client_socket;
+    unsigned long oldest = shm->version >= CHANGE_LOG_SIZE ? shm->version - CHANGE_LOG_SIZE + 1 : 1;
+    if (oldest < shm->log_base + 1) oldest = shm->log_base + 1;
+    char line[256];
+    FILE *out;
+    char *text = NULL;
+    size_t len = 0;
+
+    if (!(out = open_memstream(&text, &len))) {
+        perror("open_memstream");
         return;
     }
+    if (has_version && version <= shm->version && version + 1 >= oldest) {
+        fprintf(out, "Subscribed %lu resume\n", shm->version);
+        for (unsigned long v = version + 1; v <= shm->version; v++) {
+            format_change(&shm->change_log[v % CHANGE_LOG_SIZE], line, sizeof(line));
+            fputs(line, out);
+        }
+    } else {
+        change_event e;
+        memset(&e, 0, sizeof(e));
+        e.version = shm->version;
+        e.op = '+';
+        fprintf(out, "Subscribed %lu snapshot\n", shm->version);
+        e.kind = 'S';
+        for (int i = 0; i < MAX_SUPPLY; i++) {
+            const supdem_supply *s = supdem_engine_supply(engine, i);
+            if (!s) continue;
+            e.index = i; e.x = s->x; e.y = s->y; e.distance = s->distance;
+            e.a_amount = s->a_amount; e.b_amount = s->b_amount; e.c_amount = s->c_amount;
+            format_change(&e, line, sizeof(line));
+            fputs(line, out);
+        }
+        e.kind = 'D';
+        e.distance = 0;
+        for (int i = 0; i < MAX_DEMAND; i++) {
+            const supdem_demand *d = supdem_engine_demand(engine, i);
+            if (!d) continue;
+            e.index = i; e.x = d->x; e.y = d->y;
+            e.a_amount = d->a_amount; e.b_amount = d->b_amount; e.c_amount = d->c_amount;
+            format_change(&e, line, sizeof(line));
+            fputs(line, out);
+        }
+    }
+    fclose(out);
+    // Written under the lock, so it precedes any later event in the queue
+    send_reply(fd, text, len);
+    free(text);
+
+    if (!shm->clients[client_id].subscribed) {
+        shm->clients[client_id].subscribed = 1;
+        shm->subscriber_count++;
+    }
+}
+
+void unsubscribe_client(int client_id) {
+    if (shm->clients[client_id].subscribed) {
+        shm->clients[client_id].subscribed = 0;
+        shm->subscriber_count--;
+    }
+}
+
+// Read-only replica (-R): a process keeping its own copy of the supply and
+// demand tables, serving listings on separate endpoints so that listing
+// traffic never takes shm->mutex. The copy follows the change log without
+// locking and lags at most REPLICA_POLL_MS; only when it falls a whole log
+// behind does it copy the tables again under the lock.
+static supdem_engine *replica;
+static pthread_rwlock_t replica_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long replica_applied; // change log version of the copy
+static int replica_width, replica_height;
+
+static void replica_resync() {
+    supdem_supply *supplies = malloc(MAX_SUPPLY * sizeof(supdem_supply));
+    supdem_demand *demands = malloc(MAX_DEMAND * sizeof(supdem_demand));
+    if (!supplies || !demands) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    shm_lock(SITE_REPLICA);
+    unsigned long version = shm->version;
+    for (int i = 0; i < MAX_SUPPLY; i++) {
+        const supdem_supply *s = supdem_engine_supply(engine, i);
+        supplies[i].client_id = -1;
+        if (s) supplies[i] = *s;
+    }
+    for (int i = 0; i < MAX_DEMAND; i++) {
+        const supdem_demand *d = supdem_engine_demand(engine, i);
+        demands[i].client_id = -1;
+        if (d) demands[i] = *d;
+    }
+    shm_unlock(&shm->retired, CMD_NONE);
+
+    pthread_rwlock_wrlock(&replica_lock);
+    for (int i = 0; i < MAX_SUPPLY; i++) {
+        supdem_engine_set_supply(replica, i, supplies[i].client_id != -1 ? &supplies[i] : NULL, 0);
+    }
+    for (int i = 0; i < MAX_DEMAND; i++) {
+        supdem_engine_set_demand(replica, i, demands[i].client_id != -1 ? &demands[i] : NULL, 0);
+    }
+    replica_applied = version;
+    pthread_rwlock_unlock(&replica_lock);
+
+    shm->replica_resyncs++;
+    __atomic_store_n(&shm->replica_version, version, __ATOMIC_RELAXED);
+    free(supplies);
+    free(demands);
+}
 
-    ssize_t bytes_sent = send(client_socket, message, strlen(message), 0);
-    if (bytes_sent < 0) {
-        perror("send");
+static void replica_apply(const change_event *e) {
+    if (e->kind == 'S') {
+        supdem_supply s = { e->x, e->y, e->a_amount, e->b_amount, e->c_amount, e->distance, e->client_id };
+        supdem_engine_set_supply(replica, e->index, e->op == '-' ? NULL : &s, 0);
     } else {
+        supdem_demand d = { e->x, e->y, e->a_amount, e->b_amount, e->c_amount, e->client_id };
+        supdem_engine_set_demand(replica, e->index, e->op == '-' ? NULL : &d, 0);
+    }
+}
 
+// Applies the change log entries published since the last call. They are
+// copied without the lock and used only if the log did not wrap over them
+// meanwhile. Returns -1 when the replica has to resync.
+static int replica_catch_up() {
+    static change_event pending[CHANGE_LOG_SIZE];
+    unsigned long head = __atomic_load_n(&shm->version, __ATOMIC_ACQUIRE);
+    unsigned long first = replica_applied + 1;
+    if (head < first) return 0;
+    if (head - first >= CHANGE_LOG_SIZE - 1) return -1;
+
+    int n = 0;
+    for (unsigned long v = first; v <= head; v++) {
+        pending[n++] = shm->change_log[v % CHANGE_LOG_SIZE];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The writer may be filling the slot after the published version
+    if (__atomic_load_n(&shm->version, __ATOMIC_RELAXED) - first >= CHANGE_LOG_SIZE - 1) return -1;
+    for (int i = 0; i < n; i++) {
+        if (pending[i].version != first + i) return -1;
     }
+
+    pthread_rwlock_wrlock(&replica_lock);
+    for (int i = 0; i < n; i++) replica_apply(&pending[i]);
+    replica_applied = head;
+    pthread_rwlock_unlock(&replica_lock);
+    __atomic_store_n(&shm->replica_version, head, __ATOMIC_RELAXED);
+    return 0;
 }
 
-void remove_demand(int demand_id) {
-    memset(&shm->demands[demand_id], 0, sizeof(demand));
-    shm->demands[demand_id].client_id = -1;
+static void replica_list(int fd, int kind, int x, int y, char *args) {
+    list_query q;
+    if (parse_list_query(x, y, args, &q) < 0) {
+        write(fd, "Error: Invalid query\n", 21);
+        return;
+    }
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    pthread_rwlock_rdlock(&replica_lock);
+    format_listing(out, replica, kind, &q);
+    pthread_rwlock_unlock(&replica_lock);
+    fclose(out);
+    write(fd, text, len);
+    free(text);
+    __atomic_fetch_add(&shm->replica_listings, 1, __ATOMIC_RELAXED);
+}
+
+// One replica connection: listsupplies and listdemands with the usual
+// filters, move to set the origin of "near" for this connection, and quit
+static void *replica_session(void *arg) {
+    int fd = (int)(long)arg;
+    char buffer[1024];
+    size_t len = 0;
+    int x = 0, y = 0, quit = 0;
+
+    while (!quit && len < sizeof(buffer) - 1) {
+        ssize_t n = read(fd, buffer + len, sizeof(buffer) - len - 1);
+        if (n <= 0) break;
+        len += n;
+
+        size_t pos = 0;
+        char *nl;
+        while (!quit && (nl = memchr(buffer + pos, '\n', len - pos))) {
+            char *line = buffer + pos;
+            int nx, ny;
+            *nl = '\0';
+            pos = nl - buffer + 1;
+            if (sscanf(line, "move %d %d", &nx, &ny) == 2) {
+                if (nx < 0 || nx >= replica_width || ny < 0 || ny >= replica_height) {
+                    write(fd, "Error: Out of bounds\n", 21);
+                } else {
+                    x = nx;
+                    y = ny;
+                    write(fd, "OK\n", 3);
+                }
+            } else if (strncmp(line, "listsupplies", 12) == 0) {
+                replica_list(fd, SUPDEM_SUPPLY, x, y, line + 12);
+            } else if (strncmp(line, "listdemands", 11) == 0) {
+                replica_list(fd, SUPDEM_DEMAND, x, y, line + 11);
+            } else if (strncmp(line, "quit", 4) == 0) {
+                write(fd, "OK\n", 3);
+                quit = 1;
+            } else {
+                write(fd, "Error: Read-only replica\n", 25);
+            }
+        }
+        len -= pos;
+        memmove(buffer, buffer + pos, len);
+    }
+    close(fd);
+    return NULL;
 }
 
-void remove_supply(int supply_id) {
-    memset(&shm->supplies[supply_id], 0, sizeof(supply));
-    shm->supplies[supply_id].client_id = -1;
+static void *replica_accept_thread(void *arg) {
+    struct pollfd *pfds = arg;
+    int count = 0;
+    while (pfds[count].fd >= 0) count++;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        if (poll(pfds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            int fd = accept4(pfds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            pthread_t session;
+            if (pthread_create(&session, &attr, replica_session, (void *)(long)fd) != 0) {
+                perror("pthread_create");
+                close(fd);
+            }
+        }
+    }
+    return NULL;
 }
 
-void list_supplies(int client_id) {
+// Main of the replica process: endpoints is a comma-separated list
+void replica_loop(char *endpoints, int width, int height) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    replica_width = width;
+    replica_height = height;
+    replica = supdem_engine_create(width, height, SUPDEM_INDEX(supdem_engine_index(engine)));
+    if (!replica) {
+        perror("supdem_engine_create");
+        exit(EXIT_FAILURE);
+    }
 
+    static struct pollfd pfds[MAX_LISTENERS + 1];
     int count = 0;
-    for (int i = 0; i < MAX_SUPPLY; i++) {
-        if (shm->supplies[i].client_id != -1) {
-            count++;
+    char *save;
+    for (char *tok = strtok_r(endpoints, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (count == MAX_LISTENERS) {
+            fprintf(stderr, "Too many endpoints (max %d)\n", MAX_LISTENERS);
+            exit(EXIT_FAILURE);
         }
+        pfds[count].fd = open_listener(tok, 0);
+        pfds[count++].events = POLLIN;
     }
+    pfds[count].fd = -1;
 
-    char header[512];
-    snprintf(header, sizeof(header),
-             "There are %d supplies in total.\n"
-             "X | Y | A | B | C | D |\n"
-             "-------+-------+-----+-----+-----+-------+\n", count);
-    write(shm->clients[client_id].client_socket, header, strlen(header));
+    replica_resync();
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, replica_accept_thread, pfds) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        usleep(REPLICA_POLL_MS * 1000);
+        if (replica_catch_up() < 0) replica_resync();
+    }
+}
 
-    for (int i = 0; i < MAX_SUPPLY; i++) {
-        if (shm->supplies[i].client_id != -1) {
-            char line[128];
-            snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|%7d|\n",
-                     shm->supplies[i].x,
-                     shm->supplies[i].y,
-                     shm->supplies[i].a_amount,
-                     shm->supplies[i].b_amount,
-                     shm->supplies[i].c_amount,
-                     shm->supplies[i].distance);
-            write(shm->clients[client_id].client_socket, line, strlen(line));
+void my_supplies(int client_id) {
+    list_query q;
+    parse_list_query(0, 0, NULL, &q);
+    q.filter.owner = client_id;
+    list_query_entries(client_id, SUPDEM_SUPPLY, &q);
+}
+
+void my_demands(int client_id) {
+    list_query q;
+    parse_list_query(0, 0, NULL, &q);
+    q.filter.owner = client_id;
+    list_query_entries(client_id, SUPDEM_DEMAND, &q);
+}
+
+// Maps shared_mem with the engine block after it. With a name the region is
+// a POSIX shared memory object, replaced if it exists, that supdeminspect
+// can open; otherwise it is anonymous.
+shared_mem *map_shared_state(const char *name, size_t engine_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset = (sizeof(shared_mem) + page - 1) / page * page;
+    int fd = -1;
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            perror("shm_open");
+            exit(EXIT_FAILURE);
         }
+        if (ftruncate(fd, offset + engine_size) < 0) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+    }
+    shared_mem *mem = mmap(NULL, offset + engine_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
     }
+    if (fd >= 0) close(fd);
+
+    memset(mem, 0, sizeof(shared_mem));
+    mem->layout = sizeof(shared_mem);
+    mem->server_pid = getpid();
+    mem->engine_offset = offset;
+    mem->engine_size = engine_size;
+    return mem;
 }
 
-void list_demands(int client_id) {
+void cleanup_shared_memory() {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_destroy(&shm->clients[i].mutex);
+        pthread_cond_destroy(&shm->clients[i].condition);
+    }
+    pthread_mutex_destroy(&shm->mutex);
+    munmap(shm, shm->engine_offset + shm->engine_size);
+}
 
-    int count = 0;
-    for (int i = 0; i < MAX_DEMAND; i++) {
-        if (shm->demands[i].client_id != -1) {
-            count++;
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int hist_bucket(unsigned long ns) {
+    if (ns < (1UL << HIST_SUB_BITS)) return ns;
+    int shift = 63 - __builtin_clzl(ns) - HIST_SUB_BITS;
+    int idx = ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// Highest value that falls into bucket idx
+static unsigned long hist_bucket_max(int idx) {
+    if (idx < (1 << HIST_SUB_BITS)) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    unsigned long low = (unsigned long)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+static unsigned long hist_percentile(const latency_hist *h, double p) {
+    if (h->count == 0) return 0;
+    unsigned long rank = (unsigned long)(p * h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            unsigned long v = hist_bucket_max(i);
+            return v < h->max_ns ? v : h->max_ns;
         }
     }
+    return h->max_ns;
+}
 
-    char header[512];
-    snprintf(header, sizeof(header),
-             "There are %d demands in total.\n"
-             "X | Y | A | B | C |\n"
-             "-------+-------+-----+-----+-----+\n", count);
-    write(shm->clients[client_id].client_socket, header, strlen(header));
+void record_latency(latency_hist *h, unsigned long ns) {
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+    h->buckets[hist_bucket(ns)]++;
+}
 
-    for (int i = 0; i < MAX_DEMAND; i++) {
-        if (shm->demands[i].client_id != -1) {
-            char line[128];
-            snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|\n",
-                     shm->demands[i].x,
-                     shm->demands[i].y,
-                     shm->demands[i].a_amount,
-                     shm->demands[i].b_amount,
-                     shm->demands[i].c_amount);
-            write(shm->clients[client_id].client_socket, line, strlen(line));
+static void merge_hist(latency_hist *dst, const latency_hist *src) {
+    dst->count += src->count;
+    dst->total_ns += src->total_ns;
+    if (src->max_ns > dst->max_ns) dst->max_ns = src->max_ns;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+static void merge_lock_prof(lock_prof *dst, const lock_prof *src) {
+    dst->acquires += src->acquires;
+    dst->contended += src->contended;
+    dst->wait_ns += src->wait_ns;
+    dst->hold_ns += src->hold_ns;
+    if (src->max_wait_ns > dst->max_wait_ns) dst->max_wait_ns = src->max_wait_ns;
+    if (src->max_hold_ns > dst->max_hold_ns) dst->max_hold_ns = src->max_hold_ns;
+}
+
+void merge_stats(stats_slot *dst, const stats_slot *src) {
+    for (int i = 0; i < CMD_COUNT; i++) {
+        merge_hist(&dst->commands[i], &src->commands[i]);
+    }
+    for (int i = 0; i < SITE_COUNT; i++) {
+        for (int j = 0; j < CMD_COUNT; j++) {
+            merge_lock_prof(&dst->locks[i][j], &src->locks[i][j]);
         }
     }
+    dst->notif_enqueued += src->notif_enqueued;
+    dst->notif_dropped += src->notif_dropped;
+    dst->notif_sent += src->notif_sent;
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        dst->throttled[i] += src->throttled[i];
+    }
 }
 
-void my_supplies(int client_id) {
+// Sums all live slots and the retired aggregate. Counters are read without
+// locking, so totals may be slightly torn. Caller frees the result.
+static stats_slot *collect_stats() {
+    stats_slot *total = calloc(1, sizeof(stats_slot));
+    if (!total) {
+        perror("calloc");
+        return NULL;
+    }
+    merge_stats(total, &shm->retired);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // Slots of disconnected clients are already folded into retired
+        if (shm->clients[i].client_id != -1) {
+            merge_stats(total, &shm->stats[i]);
+        }
+    }
+    return total;
+}
 
-    int count = 0;
-    for (int i = 0; i < MAX_SUPPLY; i++) {
-        if (shm->supplies[i].client_id == client_id) {
-            count++;
+void format_stats(FILE *out) {
+    stats_slot *total = collect_stats();
+    if (!total) return;
+
+    int queued = 0, max_queued = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (shm->clients[i].client_id != -1) {
+            int depth = (shm->clients[i].notif_head - shm->clients[i].notif_tail + MAX_NOTIFICATIONS) % MAX_NOTIFICATIONS;
+            queued += depth;
+            if (depth > max_queued) max_queued = depth;
         }
     }
 
-    char header[512];
-    snprintf(header, sizeof(header),
-             "There are %d supplies in total.\n"
-             "X | Y | A | B | C | D |\n"
-             "-------+-------+-----+-----+-----+-------+\n", count);
-    write(shm->clients[client_id].client_socket, header, strlen(header));
+    supdem_counts counts;
+    supdem_engine_counts(engine, &counts);
+    fprintf(out, "Uptime %lus, %d clients, %d/%d supplies, %d/%d demands, %d/%d watches, %lu expired.\n",
+            (now_ns() - shm->start_ns) / 1000000000UL, shm->client_count,
+            counts.supplies, MAX_SUPPLY, counts.demands, MAX_DEMAND,
+            counts.watches, MAX_WATCH, counts.expired);
+    if (shm->replica_enabled) {
+        fprintf(out, "Replica: version %lu of %lu, %lu resyncs, %lu listings.\n", shm->replica_version,
+                shm->version, shm->replica_resyncs, shm->replica_listings);
+    }
+    fprintf(out, "Listings: %lu served from cache, %lu rendered.\n", shm->listing_hits, shm->listing_renders);
+    fprintf(out, "Shared notifications: %lu payloads, %lu references, %lu times none free.\n",
+            shm->payloads_created, shm->payload_refs, shm->payloads_exhausted);
+    if (snapshot_path) {
+        fprintf(out, "Snapshot: %lu saved, %lu failed, last at version %lu, %zu bytes, copied in %.1fus%s.\n",
+                shm->snapshots_saved, shm->snapshots_failed, shm->snapshot_version, shm->snapshot_bytes,
+                shm->snapshot_copy_ns / 1000.0, shm->snapshot_pid ? ", saving" : "");
+    }
+    supdem_oracle_status oracle;
+    if (supdem_engine_oracle(engine, &oracle) == 0) {
+        fprintf(out, "Oracle: %lu checks, %lu divergences.\n", oracle.checks, oracle.divergences);
+    }
+    fprintf(out, "%-13s|%10s|%10s|%10s|%10s|%10s|%10s|\n",
+            "Command", "Count", "Avg(us)", "P50(us)", "P99(us)", "P999(us)", "Max(us)");
+    for (int i = 0; i < CMD_COUNT; i++) {
+        latency_hist *h = &total->commands[i];
+        if (h->count == 0) continue;
+        fprintf(out, "%-13s|%10lu|%10.1f|%10.1f|%10.1f|%10.1f|%10.1f|\n",
+                cmd_names[i], h->count, h->total_ns / 1000.0 / h->count,
+                hist_percentile(h, 0.5) / 1000.0, hist_percentile(h, 0.99) / 1000.0,
+                hist_percentile(h, 0.999) / 1000.0, h->max_ns / 1000.0);
+    }
+    lock_prof lock = {0};
+    for (int i = 0; i < SITE_COUNT; i++) {
+        for (int j = 0; j < CMD_COUNT; j++) {
+            merge_lock_prof(&lock, &total->locks[i][j]);
+        }
+    }
+    unsigned long acq = lock.acquires ? lock.acquires : 1;
+    fprintf(out, "Lock: %lu acquires (%lu contended), wait avg %.1fus max %.1fus, hold avg %.1fus max %.1fus, %lu recoveries.\n",
+            lock.acquires, lock.contended, lock.wait_ns / 1000.0 / acq, lock.max_wait_ns / 1000.0,
+            lock.hold_ns / 1000.0 / acq, lock.max_hold_ns / 1000.0, shm->lock_recoveries);
+    fprintf(out, "Notifications: %lu enqueued, %lu sent, %lu dropped, %d queued (max %d per client).\n",
+            total->notif_enqueued, total->notif_sent, total->notif_dropped, queued, max_queued);
+    fprintf(out, "Throttled: %lu updates, %lu listings.\n", total->throttled[RATE_UPDATE], total->throttled[RATE_LISTING]);
+    free(total);
+}
 
-    for (int i = 0; i < MAX_SUPPLY; i++) {
-        if (shm->supplies[i].client_id == client_id) {
-            char line[128];
-            snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|%7d|\n",
-                     shm->supplies[i].x,
-                     shm->supplies[i].y,
-                     shm->supplies[i].a_amount,
-                     shm->supplies[i].b_amount,
-                     shm->supplies[i].c_amount,
-                     shm->supplies[i].distance);
-            write(shm->clients[client_id].client_socket, line, strlen(line));
+// Lock profile per (site, command), longest total hold time first
+void format_lock_stats(FILE *out) {
+    stats_slot *total = collect_stats();
+    if (!total) return;
+
+    lock_prof *rows[SITE_COUNT * CMD_COUNT];
+    int n = 0;
+    for (int i = 0; i < SITE_COUNT; i++) {
+        for (int j = 0; j < CMD_COUNT; j++) {
+            if (total->locks[i][j].acquires > 0) {
+                rows[n++] = &total->locks[i][j];
+            }
         }
     }
+    // Few rows, insertion sort is enough
+    for (int i = 1; i < n; i++) {
+        lock_prof *r = rows[i];
+        int k = i;
+        while (k > 0 && rows[k - 1]->hold_ns < r->hold_ns) {
+            rows[k] = rows[k - 1];
+            k--;
+        }
+        rows[k] = r;
+    }
+
+    fprintf(out, "%-9s|%-13s|%9s|%9s|%10s|%10s|%10s|%10s|%11s|\n",
+            "Site", "Command", "Acquires", "Contended", "Wait(us)", "MaxWait", "Hold(us)", "MaxHold", "TotalHold");
+    for (int i = 0; i < n; i++) {
+        int idx = rows[i] - &total->locks[0][0];
+        lock_prof *r = rows[i];
+        fprintf(out, "%-9s|%-13s|%9lu|%9lu|%10.1f|%10.1f|%10.1f|%10.1f|%11.1f|\n",
+                site_names[idx / CMD_COUNT], cmd_names[idx % CMD_COUNT], r->acquires, r->contended,
+                r->wait_ns / 1000.0 / r->acquires, r->max_wait_ns / 1000.0,
+                r->hold_ns / 1000.0 / r->acquires, r->max_hold_ns / 1000.0, r->hold_ns / 1000.0);
+    }
+    free(total);
 }
 
-void my_demands(int client_id) {
+void send_report(int client_socket, void (*format)(FILE *)) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    format(out);
+    fclose(out);
+    send_reply(client_socket, text, len);
+    free(text);
+}
 
-    int count = 0;
-    for (int i = 0; i < MAX_DEMAND; i++) {
-        if (shm->demands[i].client_id == client_id) {
-            count++;
+// Writes all of buf to fd; returns -1 on error
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        buf += n;
+        len -= n;
     }
+    return 0;
+}
 
-    char header[512];
-    snprintf(header, sizeof(header),
-             "There are %d demands in total.\n"
-             "X | Y | A | B | C |\n"
-             "-------+-------+-----+-----+-----+\n", count);
-    write(shm->clients[client_id].client_socket, header, strlen(header));
+// A demand copied for a snapshot, with its arrival rank
+typedef struct {
+    unsigned long arrival;
+    snapshot_demand record;
+} snapshot_arrival;
+
+static int by_arrival(const void *a, const void *b) {
+    const snapshot_arrival *x = a, *y = b;
+    return x->arrival < y->arrival ? -1 : x->arrival > y->arrival;
+}
 
+// Copies the live entries into a private buffer under the lock, then forks
+// a child that writes them to path.tmp and renames it over path, so the
+// file is always a complete snapshot. Returns 0 once the child is started,
+// -2 when a snapshot is still being written, -1 on failure.
+int save_snapshot(int client_id, const char *path) {
+    size_t size = sizeof(snapshot_header) + MAX_SUPPLY * sizeof(snapshot_supply) +
+                  MAX_DEMAND * sizeof(snapshot_demand);
+    char *buf = malloc(size);
+    snapshot_arrival *demands = malloc(MAX_DEMAND * sizeof(snapshot_arrival));
+    if (!buf || !demands) {
+        perror("malloc");
+        free(buf);
+        free(demands);
+        return -1;
+    }
+    snapshot_header *hdr = (snapshot_header *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SNAPSHOT_MAGIC;
+
+    shm_lock(SITE_SNAPSHOT);
+    // A writer that died is gone at once: SIGCHLD is ignored, so nothing waits for it
+    pid_t writer = shm->snapshot_pid;
+    if (writer && (kill(writer, 0) == 0 || errno != ESRCH)) {
+        shm_unlock(&shm->stats[client_id], CMD_BGSAVE);
+        free(buf);
+        free(demands);
+        return -2;
+    }
+    unsigned long start = now_ns();
+    shm->snapshot_pid = getpid();
+    hdr->version = shm->version;
+    hdr->width = shm->width;
+    hdr->height = shm->height;
+    snapshot_supply *sp = (snapshot_supply *)(hdr + 1);
+    for (int i = 0; i < MAX_SUPPLY; i++) {
+        const supdem_supply *s = supdem_engine_supply(engine, i);
+        if (!s) continue;
+        sp->index = i;
+        sp->ttl = supdem_engine_ttl(engine, SUPDEM_SUPPLY, i);
+        sp->supply = *s;
+        sp++;
+        hdr->supplies++;
+    }
     for (int i = 0; i < MAX_DEMAND; i++) {
-        if (shm->demands[i].client_id == client_id) {
-            char line[128];
-            snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|\n",
-                     shm->demands[i].x,
-                     shm->demands[i].y,
-                     shm->demands[i].a_amount,
-                     shm->demands[i].b_amount,
-                     shm->demands[i].c_amount);
-            write(shm->clients[client_id].client_socket, line, strlen(line));
+        const supdem_demand *d = supdem_engine_demand(engine, i);
+        if (!d) continue;
+        demands[hdr->demands].arrival = supdem_engine_arrival(engine, i);
+        demands[hdr->demands].record.index = i;
+        demands[hdr->demands].record.ttl = supdem_engine_ttl(engine, SUPDEM_DEMAND, i);
+        demands[hdr->demands].record.demand = *d;
+        hdr->demands++;
+    }
+    shm->snapshot_copy_ns = now_ns() - start;
+    shm_unlock(&shm->stats[client_id], CMD_BGSAVE);
+
+    // Demands go in arrival order, so a restart keeps them first come,
+    // first served
+    qsort(demands, hdr->demands, sizeof(*demands), by_arrival);
+    snapshot_demand *dp = (snapshot_demand *)sp;
+    for (int i = 0; i < hdr->demands; i++) *dp++ = demands[i].record;
+    free(demands);
+    size = (char *)dp - buf;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        __atomic_store_n(&shm->snapshot_pid, 0, __ATOMIC_RELEASE);
+        free(buf);
+        return -1;
+    }
+    if (pid > 0) {
+        // The child may be done already and have cleared it
+        pid_t self = getpid();
+        __atomic_compare_exchange_n(&shm->snapshot_pid, &self, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        free(buf);
+        return 0;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write_all(fd, buf, size) == 0 && fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (ok) {
+        shm->snapshot_version = hdr->version;
+        shm->snapshot_bytes = size;
+        __atomic_fetch_add(&shm->snapshots_saved, 1, __ATOMIC_RELAXED);
+    } else {
+        // Forked from a threaded process, so no stdio: its locks may be held
+        static const char msg[] = "Could not write the snapshot\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        unlink(tmp);
+        __atomic_fetch_add(&shm->snapshots_failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shm->snapshot_pid, 0, __ATOMIC_RELEASE);
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Warm restart: loads the entries of a snapshot written by save_snapshot()
+// into the engine with the TTLs they had left; demands are stored in file
+// order, which is their arrival order. A missing file is an empty
+// map; a file for another map size or a damaged one is fatal. The clients
+// that owned the entries are gone, and their ids will be given to others,
+// so entries are restored with SUPDEM_NO_OWNER: they can still be matched
+// or expire, but nobody is notified and no client's exit removes them.
+// The change feed resumes past the snapshot's version, and subscribers of
+// the previous run get a snapshot instead of a resume.
+void load_snapshot(const char *path, int width, int height) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        if (errno == ENOENT) return;
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    snapshot_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != SNAPSHOT_MAGIC ||
+        hdr.supplies < 0 || hdr.supplies > MAX_SUPPLY || hdr.demands < 0 || hdr.demands > MAX_DEMAND) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr.width != width || hdr.height != height) {
+        fprintf(stderr, "%s: snapshot of a %dx%d map\n", path, hdr.width, hdr.height);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < hdr.supplies; i++) {
+        snapshot_supply r;
+        int ok = fread(&r, sizeof(r), 1, in) == 1;
+        r.supply.client_id = SUPDEM_NO_OWNER;
+        if (!ok || supdem_engine_set_supply(engine, r.index, &r.supply, r.ttl) < 0) {
+            fprintf(stderr, "%s: damaged supply record %d\n", path, i);
+            exit(EXIT_FAILURE);
         }
     }
+    for (int i = 0; i < hdr.demands; i++) {
+        snapshot_demand r;
+        int ok = fread(&r, sizeof(r), 1, in) == 1;
+        r.demand.client_id = SUPDEM_NO_OWNER;
+        if (!ok || supdem_engine_set_demand(engine, r.index, &r.demand, r.ttl) < 0) {
+            fprintf(stderr, "%s: damaged demand record %d\n", path, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(in);
+    shm->log_base = shm->version = hdr.version + SNAPSHOT_VERSION_GAP;
+    fprintf(stderr, "Restored %d supplies and %d demands from %s\n", hdr.supplies, hdr.demands, path);
 }
 
-void move_client(int client_id, int x, int y) {
-    shm->clients[client_id].x = x;
-    shm->clients[client_id].y = y;
+void stats_dump_loop(const char *path, int interval) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    while (1) {
+        sleep(interval);
+        FILE *out = fopen(tmp_path, "w");
+        if (!out) {
+            perror("fopen");
+            continue;
+        }
+        format_stats(out);
+        fclose(out);
+        if (rename(tmp_path, path) < 0) {
+            perror("rename");
+        }
+    }
 }
 
-int manhattan_distance(int x1, int y1, int x2, int y2) {
-    return abs(x1 - x2) + abs(y1 - y2);
+// Profiling state of the lock held by the calling thread
+static __thread int held_site;
+static __thread int held_contended;
+static __thread unsigned long held_wait_ns;
+static __thread unsigned long held_since_ns;
+
+// Shared mutexes are robust: when a process dies holding one, the next
+// locker gets EOWNERDEAD and must repair what the lock protects
+void init_robust_mutex(pthread_mutex_t *m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
-void cleanup_shared_memory() {
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Locks m, spinning first since critical sections are short. *spins is the
+// mutex's running estimate of the spin that pays off: a busy lock is retried
+// up to twice that (plus a margin, at most LOCK_SPINS) before parking. The
+// estimate moves an eighth of the way toward the spin that got the lock, and
+// shrinks by an eighth when spinning failed, so a lock whose holders stay
+// long stops burning CPU. Races on *spins only blur the estimate.
+// Returns 0 or EOWNERDEAD; contended is set when the lock was busy.
+int lock_robust(pthread_mutex_t *m, int *spins, int *contended) {
+    int rc = pthread_mutex_trylock(m);
+    *contended = rc == EBUSY;
+    if (rc != EBUSY) return rc;
+
+    int estimate = __atomic_load_n(spins, __ATOMIC_RELAXED);
+    int limit = estimate * 2 + 10 < LOCK_SPINS ? estimate * 2 + 10 : LOCK_SPINS;
+    int tries = 0;
+    while (rc == EBUSY && tries < limit) {
+        cpu_relax();
+        tries++;
+        rc = pthread_mutex_trylock(m);
+    }
+    if (rc == EBUSY) {
+        estimate -= estimate / 8 + 1;
+        rc = pthread_mutex_lock(m);
+    } else {
+        estimate += (tries - estimate) / 8;
+    }
+    __atomic_store_n(spins, estimate > 0 ? estimate : 0, __ATOMIC_RELAXED);
+    return rc;
+}
+
+// A client's mutex only guards its notification queue; a dead holder can
+// at worst leave the message at notif_head half copied, which is harmless
+void lock_client(int client_id) {
+    client *cl = &shm->clients[client_id];
+    int contended;
+    if (lock_robust(&cl->mutex, &cl->spins, &contended) == EOWNERDEAD) {
+        if (cl->notif_head < 0 || cl->notif_head >= MAX_NOTIFICATIONS ||
+            cl->notif_tail < 0 || cl->notif_tail >= MAX_NOTIFICATIONS) {
+            cl->notif_head = cl->notif_tail = 0;
+        }
+        pthread_mutex_consistent(&cl->mutex);
+    }
+}
+
+// Called with shm->mutex taken over from a process that died holding it,
+// possibly in the middle of an engine operation or a client table update.
+// Rebuilds what can be derived, finishes delivering the events the dead
+// holder had queued, and releases the clients of dead processes, whose
+// connections went away with them.
+void recover_shared_state() {
+    shm->lock_recoveries++;
+    supdem_engine_repair(engine);
+    dispatch_events();
+    // Repair drops broken entries without change events. Moving the feed to
+    // a version past the log makes cached listings stale, resyncs the
+    // replica and gives resuming subscribers a snapshot; live subscribers
+    // see the jump and resubscribe.
+    shm->log_base = shm->version + 1;
+    __atomic_store_n(&shm->version, shm->log_base, __ATOMIC_RELEASE);
+
+    shm->client_count = 0;
+    shm->subscriber_count = 0;
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_mutex_destroy(&shm->clients[i].mutex);
-        pthread_cond_destroy(&shm->clients[i].condition);
+        client *cl = &shm->clients[i];
+        if (cl->client_socket == -1) continue;
+        cl->client_id = i;
+        shm->client_count++;
+        shm->subscriber_count += cl->subscribed != 0;
     }
-    pthread_mutex_destroy(&shm->mutex);
-    munmap(shm, sizeof(shared_mem));
+    int released = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        client *cl = &shm->clients[i];
+        if (cl->client_socket != -1 && kill(cl->pid, 0) < 0 && errno == ESRCH) {
+            release_client(i);
+            released++;
+        }
+    }
+    fprintf(stderr, "Recovered the shared lock from a dead process, released %d clients\n", released);
+}
+
+// All acquisitions of shm->mutex go through shm_lock/shm_unlock so that wait
+// and hold times can be attributed to a call site and command.
+void shm_lock(int site) {
+    unsigned long start = now_ns();
+    int contended;
+    int rc = lock_robust(&shm->mutex, &shm->spins, &contended);
+    held_since_ns = now_ns();
+
+    // A dead holder left lock_seq odd; it stays odd, but changes
+    unsigned long seq = shm->lock_seq;
+    __atomic_store_n(&shm->lock_seq, seq + (seq & 1 ? 2 : 1), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->lock_pid = getpid();
+    shm->lock_tid = syscall(SYS_gettid);
+    shm->lock_site = site;
+    shm->lock_since_ns = held_since_ns;
+
+    if (rc == EOWNERDEAD) {
+        recover_shared_state();
+        pthread_mutex_consistent(&shm->mutex);
+    }
+    held_wait_ns = held_since_ns - start;
+    held_site = site;
+    held_contended = contended;
+    trace_event(TRACE_LOCK_ACQUIRE, CMD_NONE, held_wait_ns > 0xffffffffUL ? 0xffffffffU : held_wait_ns);
+}
+
+// The profile is written to st while still holding the lock, so st may be a
+// shared aggregate such as shm->retired.
+void shm_unlock(stats_slot *st, int cmd) {
+    unsigned long hold = now_ns() - held_since_ns;
+    lock_prof *p = &st->locks[held_site][cmd];
+    p->acquires++;
+    p->contended += held_contended;
+    p->wait_ns += held_wait_ns;
+    p->hold_ns += hold;
+    if (held_wait_ns > p->max_wait_ns) p->max_wait_ns = held_wait_ns;
+    if (hold > p->max_hold_ns) p->max_hold_ns = hold;
+    trace_event(TRACE_LOCK_RELEASE, cmd, 0);
+    shm->lock_pid = 0;
+    __atomic_store_n(&shm->lock_seq, shm->lock_seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shm->mutex);
+}
+
+// Trace identity of the calling thread
+static __thread int trace_slot = -1;
+static __thread unsigned int trace_tid;
+
+void trace_attach(int client_id) {
+    trace_slot = client_id;
+    trace_tid = syscall(SYS_gettid);
+}
+
+// Appends one record to the calling thread's ring. The command and
+// notification threads of a client share a ring, hence the atomic slot claim.
+void trace_event(int type, int cmd, unsigned int arg) {
+    if (!traces || trace_slot < 0) return;
+    trace_ring *ring = &traces[trace_slot];
+    unsigned long i = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_record *r = &ring->records[i & (TRACE_RING_SIZE - 1)];
+    r->pid = getpid();
+    r->tid = trace_tid;
+    r->client_id = trace_slot;
+    r->type = type;
+    r->cmd = cmd;
+    r->arg = arg;
+    __atomic_store_n(&r->ts_ns, now_ns(), __ATOMIC_RELEASE);
+}
+
+// Writes the retained part of every ring, oldest record first. Rings are read
+// while agents keep appending, so the newest records of a busy ring may be torn.
+int dump_traces(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+
+    trace_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.cmd_count = CMD_COUNT;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        strncpy(hdr.cmd_names[i], cmd_names[i], TRACE_NAME_LEN - 1);
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    for (int c = 0; c < MAX_CLIENTS; c++) {
+        trace_ring *ring = &traces[c];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long i = first; i < head; i++) {
+            trace_record *r = &ring->records[i & (TRACE_RING_SIZE - 1)];
+            if (__atomic_load_n(&r->ts_ns, __ATOMIC_ACQUIRE) == 0) continue;
+            fwrite(r, sizeof(*r), 1, out);
+            hdr.record_count++;
+        }
+    }
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    if (fclose(out) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
 }
@@ -0,0 +1,250 @@
+#ifndef SUPDEMSHM_H
+#define SUPDEMSHM_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "supdem_engine.h"
+
+// Layout of the state shared by the supdemserv processes, also read by the
+// supdeminspect tool. The region holds shared_mem at offset 0 and the engine
+// block at engine_offset. With -m it is a named POSIX shared memory object
+// that outlives the server until replaced by the next one.
+
+#define SHM_MAGIC 0x4d534453 // "SDSM"
+
+#define MAX_CLIENTS SUPDEM_MAX_CLIENTS
+#define MAX_SUPPLY SUPDEM_MAX_SUPPLY
+#define MAX_DEMAND SUPDEM_MAX_DEMAND
+#define MAX_WATCH SUPDEM_MAX_WATCH
+#define MAX_NOTIFICATIONS 1000
+#define MAX_PAYLOADS 4096 // notifications shared by several queues
+#define MAX_WORKERS 64
+
+#define CHANGE_LOG_SIZE 4096
+#define MAX_ENTRIES (MAX_SUPPLY > MAX_DEMAND ? MAX_SUPPLY : MAX_DEMAND)
+
+// Room for a rendered unfiltered listing; longer ones are sent uncached
+#define LISTING_ROW_MAX 64
+#define LISTING_CACHE_SIZE (128 + MAX_ENTRIES * LISTING_ROW_MAX)
+
+// Latency histograms: log-linear buckets with 2^HIST_SUB_BITS sub-buckets per
+// power of two (~12% precision), covering up to 2^40 ns.
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (40 << HIST_SUB_BITS)
+
+enum {
+    CMD_MOVE,
+    CMD_DEMAND,
+    CMD_SUPPLY,
+    CMD_WATCH,
+    CMD_UNWATCH,
+    CMD_LISTSUPPLIES,
+    CMD_LISTDEMANDS,
+    CMD_NEAREST,
+    CMD_MYSUPPLIES,
+    CMD_MYDEMANDS,
+    CMD_SUPPLYBATCH,
+    CMD_DEMANDBATCH,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_STATS,
+    CMD_LOCKSTATS,
+    CMD_TRACEDUMP,
+    CMD_BGSAVE,
+    CMD_QUIT,
+    CMD_INVALID,
+    CMD_NONE, // lock taken outside of a command
+    CMD_COUNT
+};
+
+static const char *cmd_names[CMD_COUNT] = {
+    "move", "demand", "supply", "watch", "unwatch",
+    "listsupplies", "listdemands", "nearest", "mysupplies", "mydemands", "supplybatch", "demandbatch",
+    "subscribe", "unsubscribe",
+    "stats", "lockstats", "tracedump", "bgsave", "quit", "invalid", "-"
+};
+
+// Places where the global lock is taken
+enum {
+    SITE_REGISTER,
+    SITE_COMMAND,
+    SITE_CLEANUP,
+    SITE_EXPIRE,
+    SITE_REPLICA,
+    SITE_SNAPSHOT,
+    SITE_COUNT
+};
+
+static const char *site_names[SITE_COUNT] = {
+    "register", "command", "cleanup", "expire", "replica", "snapshot"
+};
+
+// Classes of commands limited by per-client token buckets (-u, -l)
+enum {
+    RATE_UPDATE,  // commands that change tables, positions or watches
+    RATE_LISTING, // listings, nearest, subscribe snapshots and bgsave
+    RATE_CLASSES
+};
+
+typedef struct {
+    double tokens;
+    unsigned long stamp_ns; // of the last refill, 0 for a full bucket
+} token_bucket;
+
+// A queued notification: its own message, or a reference to a payload
+// shared with other queues
+typedef struct {
+    int payload; // index in shm->payloads, -1 for message
+    char message[256];
+} notification;
+
+// Text sent to many clients alike (watch hits, change feed), rendered once.
+// refs counts the queue entries holding it and is dropped without the
+// global lock; a payload is reused, under the lock, only once it is 0.
+typedef struct {
+    int refs;
+    int len;
+    char text[256];
+} notification_payload;
+
+typedef struct
+{
+    int client_id;
+    pthread_mutex_t mutex;
+    int spins; // lock_robust()'s spin estimate for mutex
+    pthread_cond_t condition;
+    int client_socket;
+
+    // Notification queue
+    notification notifications[MAX_NOTIFICATIONS];
+    int notif_head;
+    int notif_tail;
+
+    int subscribed; // receives change feed events
+    int worker;     // event-loop worker serving the client, -1 for a thread
+    pid_t pid;      // process serving the client
+
+    // Used only by the thread running the client's commands
+    token_bucket buckets[RATE_CLASSES];
+} client;
+
+// One entry of the change feed: '+' insert, '~' update, '-' remove of a
+// supply ('S') or demand ('D') slot
+typedef struct {
+    unsigned long version;
+    char op;
+    char kind;
+    int index;
+    int x, y;
+    int a_amount, b_amount, c_amount;
+    int distance;
+    int client_id; // owner; not part of the feed
+} change_event;
+
+// Unfiltered listsupplies or listdemands output as of a change feed version.
+// Every mutation bumps the version, so it stays valid until the next one.
+typedef struct {
+    unsigned long version;
+    size_t len; // 0 when nothing is cached
+    char text[LISTING_CACHE_SIZE];
+} listing_cache;
+
+typedef struct {
+    unsigned long count;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned int buckets[HIST_BUCKETS];
+} latency_hist;
+
+// Global lock profile for one (site, command) pair
+typedef struct {
+    unsigned long acquires;
+    unsigned long contended; // trylock failed, had to block
+    unsigned long wait_ns;
+    unsigned long max_wait_ns;
+    unsigned long hold_ns;
+    unsigned long max_hold_ns;
+} lock_prof;
+
+// Per-client counters. Each slot is written only by the agent serving that
+// client (notification counters under the client's mutex), so updates never
+// contend; readers aggregate all slots without locking.
+typedef struct {
+    latency_hist commands[CMD_COUNT];
+    lock_prof locks[SITE_COUNT][CMD_COUNT];
+    unsigned long notif_enqueued;
+    unsigned long notif_dropped;
+    unsigned long notif_sent;
+    unsigned long throttled[RATE_CLASSES];
+} stats_slot;
+
+typedef struct
+{
+    unsigned int magic;   // SHM_MAGIC once initialized
+    unsigned int layout;  // sizeof(shared_mem), to catch a stale inspector
+    pid_t server_pid;
+    size_t engine_offset; // of the engine block in the region
+    size_t engine_size;
+
+    // Holder of mutex, written just after taking it: readers without the
+    // lock can tell who holds it. lock_seq is a sequence lock over the
+    // engine and everything else mutex guards: odd while mutex is held,
+    // bumped on every take and release.
+    unsigned long lock_seq;
+    pid_t lock_pid;  // 0 when free
+    pid_t lock_tid;
+    int lock_site;
+    unsigned long lock_since_ns; // CLOCK_MONOTONIC
+
+    pthread_mutex_t mutex; // guards the engine and everything below
+    int spins;             // lock_robust()'s spin estimate for mutex
+    client clients[MAX_CLIENTS];
+
+    // Change feed: every mutation of supplies/demands bumps version and is
+    // logged in a ring so subscribers can resume after a gap
+    unsigned long version;
+    unsigned long log_base; // versions below it are not in the log: from before a restart or a repair
+    change_event change_log[CHANGE_LOG_SIZE];
+    int subscriber_count;
+
+    int client_count;
+
+    int doorbell_rung[MAX_WORKERS]; // coalesces wakeups of pre-fork workers
+
+    unsigned long oracle_reported; // engine divergences already logged
+    unsigned long lock_recoveries; // times mutex was taken over from a dead holder
+
+    // Written by the replica process, if any
+    int replica_enabled;
+    unsigned long replica_version;  // change log version the replica reflects
+    unsigned long replica_resyncs;
+    unsigned long replica_listings;
+
+    // Background snapshots; snapshot_pid is the process writing one, or 0
+    pid_t snapshot_pid;
+    unsigned long snapshots_saved;
+    unsigned long snapshots_failed;
+    unsigned long snapshot_version;  // of the last snapshot written
+    unsigned long snapshot_copy_ns;  // lock hold of the last copy
+    size_t snapshot_bytes;
+
+    // Rendered unfiltered listings by kind, rebuilt on the first request
+    // after a change
+    listing_cache listings[2];
+    unsigned long listing_hits;
+    unsigned long listing_renders;
+
+    notification_payload payloads[MAX_PAYLOADS];
+    int payload_cursor;              // where the search for a free one starts
+    unsigned long payloads_created;
+    unsigned long payload_refs;      // notifications queued by reference
+    unsigned long payloads_exhausted; // fell back to copies, none was free
+
+    stats_slot stats[MAX_CLIENTS];
+    stats_slot retired; // counters of disconnected clients
+    unsigned long start_ns;
+    int width, height; // of the map
+} shared_mem;
+
+#endif
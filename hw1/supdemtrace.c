@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "supdemtrace.h"
+
+// Converts a supdemserv trace dump into Chrome trace event JSON, viewable in
+// chrome://tracing or ui.perfetto.dev. Commands and lock holds become nested
+// duration slices on the agent's command thread; matches, enqueues and sends
+// become instant events.
+
+#define MAX_OPEN 4096
+
+// Commands are only named once parsed, so a begin record is held until its
+// end record arrives and the pair is emitted as one complete ("X") event.
+static struct {
+    uint32_t tid;
+    uint64_t ts_ns;
+} open_cmds[MAX_OPEN];
+static int open_count;
+
+static int take_open(uint32_t tid, uint64_t *ts_ns) {
+    for (int i = 0; i < open_count; i++) {
+        if (open_cmds[i].tid == tid) {
+            *ts_ns = open_cmds[i].ts_ns;
+            open_cmds[i] = open_cmds[--open_count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *cmd_name(const trace_file_header *hdr, int cmd) {
+    if (cmd < 0 || cmd >= (int)hdr->cmd_count) return "?";
+    return hdr->cmd_names[cmd];
+}
+
+static void emit(FILE *out, int *first, const trace_record *r, const char *ph,
+                 const char *name, const char *args) {
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u%s%s}",
+            *first ? "" : ",", name, ph, r->ts_ns / 1000.0, r->pid, r->tid,
+            ph[0] == 'i' ? ",\"s\":\"t\"" : "", args);
+    *first = 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <tracefile> [output.json]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = stdout;
+    if (argc == 3 && !(out = fopen(argv[2], "w"))) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    trace_file_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a supdemserv trace\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    int first = 1;
+    char args[128];
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint64_t i = 0; i < hdr.record_count; i++) {
+        trace_record r;
+        if (fread(&r, sizeof(r), 1, in) != 1) {
+            fprintf(stderr, "%s: truncated after %lu records\n", argv[1], (unsigned long)i);
+            break;
+        }
+        switch (r.type) {
+        case TRACE_CMD_BEGIN: {
+            uint64_t ignored;
+            take_open(r.tid, &ignored); // end record lost to ring wrap
+            if (open_count < MAX_OPEN) {
+                open_cmds[open_count].tid = r.tid;
+                open_cmds[open_count].ts_ns = r.ts_ns;
+                open_count++;
+            }
+            break;
+        }
+        case TRACE_CMD_END: {
+            uint64_t begin;
+            if (!take_open(r.tid, &begin)) break; // begin record lost to ring wrap
+            snprintf(args, sizeof(args), ",\"dur\":%.3f,\"args\":{\"client\":%u}",
+                     (r.ts_ns - begin) / 1000.0, r.client_id);
+            r.ts_ns = begin;
+            emit(out, &first, &r, "X", cmd_name(&hdr, r.cmd), args);
+            break;
+        }
+        case TRACE_LOCK_ACQUIRE:
+            snprintf(args, sizeof(args), ",\"args\":{\"client\":%u,\"wait_us\":%.3f}", r.client_id, r.arg / 1000.0);
+            emit(out, &first, &r, "B", "shm->mutex", args);
+            break;
+        case TRACE_LOCK_RELEASE:
+            emit(out, &first, &r, "E", "shm->mutex", "");
+            break;
+        case TRACE_MATCH:
+            snprintf(args, sizeof(args), ",\"args\":{\"demand_client\":%u,\"supply_client\":%u}", r.arg >> 16, r.arg & 0xffff);
+            emit(out, &first, &r, "i", "match", args);
+            break;
+        case TRACE_ENQUEUE:
+            snprintf(args, sizeof(args), ",\"args\":{\"target\":%u}", r.arg);
+            emit(out, &first, &r, "i", "enqueue", args);
+            break;
+        case TRACE_SEND:
+            snprintf(args, sizeof(args), ",\"args\":{\"bytes\":%u}", r.arg);
+            emit(out, &first, &r, "i", "send", args);
+            break;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    fclose(in);
+    if (out != stdout) fclose(out);
+    return 0;
+}
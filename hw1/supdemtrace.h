@@ -0,0 +1,48 @@
+#ifndef SUPDEMTRACE_H
+#define SUPDEMTRACE_H
+
+#include <stdint.h>
+
+// Binary event trace shared between supdemserv and the supdemtrace converter.
+// Each client slot owns a ring of TRACE_RING_SIZE records in shared memory;
+// "tracedump" writes every ring to the trace file in the layout below:
+// a trace_file_header followed by record_count trace_records.
+
+#define TRACE_RING_SIZE 8192 // power of two
+#define TRACE_MAGIC 0x52544453 // "SDTR"
+#define TRACE_MAX_CMDS 64
+#define TRACE_NAME_LEN 16
+
+enum {
+    TRACE_CMD_BEGIN,
+    TRACE_CMD_END,
+    TRACE_LOCK_ACQUIRE, // arg: wait time in ns
+    TRACE_LOCK_RELEASE,
+    TRACE_MATCH,        // arg: demand owner << 16 | supply owner
+    TRACE_ENQUEUE,      // arg: target client
+    TRACE_SEND,         // arg: bytes sent
+};
+
+typedef struct {
+    uint64_t ts_ns; // CLOCK_MONOTONIC
+    uint32_t pid;
+    uint32_t tid;
+    uint16_t client_id;
+    uint8_t type;
+    uint8_t cmd;
+    uint32_t arg;
+} trace_record;
+
+typedef struct {
+    uint64_t head; // total records ever appended
+    trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cmd_count;
+    uint64_t record_count;
+    char cmd_names[TRACE_MAX_CMDS][TRACE_NAME_LEN];
+} trace_file_header;
+
+#endif